@@ -0,0 +1,102 @@
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "calib.h"
+
+/* Bumped when the layout of struct calib changes */
+#define CALIB_VERSION 1
+
+/* Raw deflection of a stick at full range, the defaults scale 1:1 */
+#ifndef CALIB_DEFAULT_DEADZONE
+#define CALIB_DEFAULT_DEADZONE 0
+#endif
+#ifndef CALIB_DEFAULT_RANGE
+#define CALIB_DEFAULT_RANGE 127
+#endif
+
+uint8_t calib_luts[STICK_AXES][256];
+
+static struct calib calib;
+/* Set by the USB interrupt, the tables are rebuilt in the main loop */
+static struct calib calib_new;
+static volatile uint8_t calib_pending;
+
+static uint8_t calib_eeprom_version EEMEM;
+static struct calib calib_eeprom EEMEM;
+
+static void calib_build_luts(void)
+{
+    uint8_t i;
+
+    /* joy_y and c_y are flipped */
+    for (i = 0; i < STICK_AXES; ++i)
+        stick_lut_build(calib_luts[i], calib.axes[i].deadzone,
+                        calib.axes[i].range, i & 1);
+}
+
+static int8_t calib_valid(const struct calib *c)
+{
+    uint8_t i;
+
+    for (i = 0; i < STICK_AXES; ++i) {
+        if (c->axes[i].range > 127 ||
+            c->axes[i].range <= c->axes[i].deadzone)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Loads the parameters from the EEPROM, or the defaults if there are none */
+void calib_init(void)
+{
+    uint8_t i;
+
+    eeprom_read_block(&calib, &calib_eeprom, sizeof(calib));
+    if (eeprom_read_byte(&calib_eeprom_version) != CALIB_VERSION ||
+        !calib_valid(&calib)) {
+        for (i = 0; i < STICK_AXES; ++i) {
+            calib.axes[i].deadzone = CALIB_DEFAULT_DEADZONE;
+            calib.axes[i].range = CALIB_DEFAULT_RANGE;
+        }
+    }
+    calib_build_luts();
+}
+
+const struct calib *calib_get(void)
+{
+    return &calib;
+}
+
+/*
+ * Takes new parameters into use from the next calib_update(). Called from
+ * the USB interrupt, where building the tables would take too long.
+ */
+int8_t calib_set(const struct calib *c)
+{
+    if (!calib_valid(c))
+        return -1;
+    calib_new = *c;
+    calib_pending = 1;
+    return 0;
+}
+
+/*
+ * Rebuilds the tables and stores the parameters if they were changed. Takes
+ * a few milliseconds, so the polls are skipped meanwhile.
+ */
+void calib_update(void)
+{
+    if (!calib_pending)
+        return;
+
+    cli();
+    calib = calib_new;
+    calib_pending = 0;
+    sei();
+
+    calib_build_luts();
+    eeprom_update_block(&calib, &calib_eeprom, sizeof(calib));
+    eeprom_update_byte(&calib_eeprom_version, CALIB_VERSION);
+}
@@ -0,0 +1,26 @@
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <stdint.h>
+
+#include "decode.h"
+
+/* The parameters of a stick axis, both in raw units from the origin */
+struct calib_axis {
+    uint8_t deadzone;
+    uint8_t range;
+};
+
+/* This is also the feature report */
+struct calib {
+    struct calib_axis axes[STICK_AXES];
+} __attribute__((packed));
+
+extern uint8_t calib_luts[STICK_AXES][256];
+
+void calib_init(void);
+const struct calib *calib_get(void);
+int8_t calib_set(const struct calib *calib);
+void calib_update(void);
+
+#endif
@@ -1,7 +1,120 @@
 #ifndef CONTROLLER_H
 #define CONTROLLER_H
 
-extern void controller_probe(void);
-extern void controller_poll(void *addr, uint8_t sz);
+/*
+ * A bit is sampled four times. The samples are weighted 1, 2, 2, 1 and the
+ * bit is one if the sum is above the threshold.
+ */
+#define ENC_BIT_THRESHOLD 2 /* This seems to work the best */
+
+/* Number of bits in the response to the poll command */
+#define CONTROLLER_POLL_BITS 64
+#define CONTROLLER_POLL_BYTES (CONTROLLER_POLL_BITS / 8)
+/* controller_poll_sliced() also receives the stop bit */
+#define CONTROLLER_SLICES (CONTROLLER_POLL_BITS + 1)
+
+/* Joybus commands */
+#define JOYBUS_CMD_PROBE 0x00
+#define JOYBUS_CMD_POLL 0x40
+#define JOYBUS_CMD_ORIGIN 0x41
+
+#define JOYBUS_POLL_CMD_BYTES 3
+
+/* Length of the probe response, the device type and status */
+#define JOYBUS_PROBE_BYTES 3
+
+/* Bits of the device type in the first two bytes of the probe response */
+#define JOYBUS_ID0_WIRELESS 0x80    /* WaveBird receiver */
+#define JOYBUS_ID0_RECEIVED 0x40    /* The receiver has heard a controller */
+#define JOYBUS_ID0_NO_MOTOR 0x20
+#define JOYBUS_ID0_GC 0x08          /* Any GameCube device */
+#define JOYBUS_ID0_STANDARD 0x01    /* Standard controller protocol */
+#define JOYBUS_ID1_KEYBOARD 0x20
+
+/* How long joybus_transfer() waits for the response to start */
+#define JOYBUS_TIMEOUT_US 100
+
+/*
+ * Set in the return value of joybus_transfer() if the response ended with
+ * the stop bit, the rest is the number of bytes received
+ */
+#define JOYBUS_RX_STOP 0x80
+#define JOYBUS_RX_LEN(ret) ((ret) & ~JOYBUS_RX_STOP)
+
+/*
+ * Analog mode sent in the poll command. The modes trade the resolution of
+ * the C stick, the analog triggers and the analog A and B buttons, see
+ * joypad_response_unpack().
+ */
+#ifndef ANALOG_MODE
+#define ANALOG_MODE 3
+#endif
+#define ANALOG_MODE_MAX 4
+
+#if ANALOG_MODE > ANALOG_MODE_MAX
+#error "ANALOG_MODE must be 0 to 4"
+#endif
+
+/*
+ * With several ports all the lines are polled at once and the responses are
+ * received bit sliced, unless the raw samples are wanted.
+ */
+#define CONTROLLER_SLICED (CONTROLLER_PORTS > 1 && !CONTROLLER_RAW_SAMPLES)
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+/* Outcome of a poll */
+enum controller_status {
+    CONTROLLER_OK,
+    CONTROLLER_TIMEOUT,     /* No response */
+    CONTROLLER_BAD_LENGTH,  /* Too short or too long response */
+    CONTROLLER_BAD_STOP,    /* No stop bit right after the response */
+    CONTROLLER_BAD_BITS,    /* Wrong fixed bits in the status bytes */
+    CONTROLLER_TX_LATE,     /* The SPI transmitter fell behind the command */
+    CONTROLLER_STATUSES
+};
+
+/* What answered the probe command */
+enum joybus_device {
+    JOYBUS_DEVICE_NONE,         /* Nothing, or a WaveBird receiver alone */
+    JOYBUS_DEVICE_STANDARD,
+    JOYBUS_DEVICE_WAVEBIRD,
+    JOYBUS_DEVICE_KEYBOARD,
+    JOYBUS_DEVICE_UNKNOWN,
+};
+
+/* The analog mode of the next poll, read by controller.S */
+extern uint8_t controller_mode;
+/* Rumble on, one bit per port and one bit per data line */
+extern uint8_t controller_rumble;
+extern uint8_t controller_rumble_lines;
+
+extern uint8_t joybus_transfer(uint8_t port, const void *tx, uint8_t tx_len,
+                               void *rx, uint8_t rx_len);
+extern void joybus_transfer_raw(uint8_t port, const void *tx, uint8_t tx_len,
+                                void *buf, uint8_t sz);
+extern uint8_t joybus_stop_rx(uint8_t port, void *rx, uint8_t rx_len);
+extern uint8_t controller_poll_sliced(uint8_t *slices, uint8_t follow);
+
+void controller_poll_cmd(uint8_t port, uint8_t *cmd);
+uint8_t controller_probe(uint8_t port, uint8_t *id);
+uint8_t controller_device(const uint8_t *id);
+uint8_t controller_poll(uint8_t port, void *report, uint8_t sz);
+void controller_poll_raw(uint8_t port, void *buf, uint8_t sz);
+void controller_send_poll(uint8_t port);
+uint8_t controller_recv(uint8_t port, void *report, uint8_t sz);
+uint8_t controller_origin(uint8_t port, void *report, uint8_t sz);
+
+void controller_icp_init(void);
+void controller_icp_start(void);
+uint8_t controller_icp_wait(void *report, uint8_t sz);
+uint8_t controller_icp_poll(void *report, uint8_t sz);
+
+void controller_spi_init(void);
+uint8_t controller_spi_poll(void *report, uint8_t sz);
+
+#endif
 
 #endif
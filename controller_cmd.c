@@ -0,0 +1,123 @@
+#include <stddef.h>
+
+#include "controller.h"
+
+/*
+ * The Joybus commands, built on joybus_transfer() in controller.S. Only the
+ * bytes differ between the commands, the timing is all in there.
+ */
+
+/* Checks the length and the stop bit of a response of sz bytes */
+static uint8_t controller_rx_status(uint8_t ret, uint8_t sz)
+{
+    if (!ret)
+        return CONTROLLER_TIMEOUT;
+    if (JOYBUS_RX_LEN(ret) != sz)
+        return CONTROLLER_BAD_LENGTH;
+    if (!(ret & JOYBUS_RX_STOP))
+        return CONTROLLER_BAD_STOP;
+    return CONTROLLER_OK;
+}
+
+/* The poll command with the current analog mode and the rumble of the port */
+void controller_poll_cmd(uint8_t port, uint8_t *cmd)
+{
+    cmd[0] = JOYBUS_CMD_POLL;
+    cmd[1] = controller_mode;
+    /* 0x02 stops the motor with the brake */
+    cmd[2] = (controller_rumble & (1<<port)) ? 0x01 : 0x02;
+}
+
+/*
+ * Probes the controller and stores the JOYBUS_PROBE_BYTES byte response, the
+ * device type and status, to id. Returns one of enum controller_status.
+ */
+uint8_t controller_probe(uint8_t port, uint8_t *id)
+{
+    static const uint8_t cmd = JOYBUS_CMD_PROBE;
+
+    return controller_rx_status(joybus_transfer(port, &cmd, sizeof(cmd), id,
+                                                JOYBUS_PROBE_BYTES),
+                                JOYBUS_PROBE_BYTES);
+}
+
+/*
+ * Tells the device from a probe response. A WaveBird receiver that hasn't
+ * heard its controller answers polls with nothing useful, so it counts as
+ * no device until it has.
+ */
+uint8_t controller_device(const uint8_t *id)
+{
+    if (!(id[0] & JOYBUS_ID0_GC))
+        return JOYBUS_DEVICE_UNKNOWN;
+    if (id[0] & JOYBUS_ID0_WIRELESS) {
+        if (!(id[0] & JOYBUS_ID0_RECEIVED))
+            return JOYBUS_DEVICE_NONE;
+        return JOYBUS_DEVICE_WAVEBIRD;
+    }
+    if (id[0] & JOYBUS_ID0_STANDARD)
+        return JOYBUS_DEVICE_STANDARD;
+    if (id[1] & JOYBUS_ID1_KEYBOARD)
+        return JOYBUS_DEVICE_KEYBOARD;
+    return JOYBUS_DEVICE_UNKNOWN;
+}
+
+/*
+ * Polls the controller and stores sz decoded bytes to report. Returns one of
+ * enum controller_status, the fixed bits are left to the caller.
+ */
+uint8_t controller_poll(uint8_t port, void *report, uint8_t sz)
+{
+    uint8_t cmd[JOYBUS_POLL_CMD_BYTES];
+
+    controller_poll_cmd(port, cmd);
+    return controller_rx_status(joybus_transfer(port, cmd, sizeof(cmd),
+                                                report, sz), sz);
+}
+
+#if CONTROLLER_RAW_SAMPLES
+/*
+ * Polls the controller and stores sz bytes of the oversampled response to
+ * buf, four samples per bit.
+ */
+void controller_poll_raw(uint8_t port, void *buf, uint8_t sz)
+{
+    uint8_t cmd[JOYBUS_POLL_CMD_BYTES];
+
+    controller_poll_cmd(port, cmd);
+    joybus_transfer_raw(port, cmd, sizeof(cmd), buf, sz);
+}
+#endif
+
+/* Only sends the poll command, the response is left to another receiver */
+void controller_send_poll(uint8_t port)
+{
+    uint8_t cmd[JOYBUS_POLL_CMD_BYTES];
+
+    controller_poll_cmd(port, cmd);
+    joybus_transfer(port, cmd, sizeof(cmd), NULL, 0);
+}
+
+#if CONTROLLER_SPI
+/*
+ * Sends the stop bit of a command sent by someone else, the SPI transmitter,
+ * and receives the response. Must be called right after the last bit.
+ */
+uint8_t controller_recv(uint8_t port, void *report, uint8_t sz)
+{
+    return controller_rx_status(joybus_stop_rx(port, report, sz), sz);
+}
+#endif
+
+/*
+ * Reads the origin, i.e. the resting positions of the sticks and triggers.
+ * The 10 byte response has the layout of the mode 3 poll response followed
+ * by two more bytes.
+ */
+uint8_t controller_origin(uint8_t port, void *report, uint8_t sz)
+{
+    static const uint8_t cmd = JOYBUS_CMD_ORIGIN;
+
+    return controller_rx_status(joybus_transfer(port, &cmd, sizeof(cmd),
+                                                report, sz), sz);
+}
@@ -0,0 +1,100 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "controller.h"
+#include "decode.h"
+#include "iodefs.h"
+#include "sched.h"
+
+#if CONTROLLER_ICP
+
+/*
+ * Interrupt driven receiver using the Timer1 input capture unit. The data
+ * line is on ICP1 and the timer captures every rising edge. The capture
+ * interrupt in controller.S only stores the low byte of ICR1, which is
+ * enough because the edges are at most 1.5 bits apart.
+ *
+ * The rising edge of a bit comes 1/4 of the bit time after its start for a
+ * one and 3/4 for a zero. The distance between two rising edges is thus
+ * half, one or one and a half bit times. A half means the bit changed from
+ * zero to one, one and a half from one to zero, and a full bit time that
+ * the bit stayed the same. The first bit of the response is always zero.
+ * Every full bit time distance is also used to follow the actual bit rate
+ * of the controller. The rising edge of the stop bit is captured as well,
+ * so a missed capture makes the response one edge short and it times out
+ * instead of decoding the stop bit as the last data bit. The decoding is
+ * done by controller_decode_icp().
+ */
+
+#define ICP_TICKS_PER_BIT (F_CPU / 250000UL)
+
+/* At 8 MHz the capture interrupt can't read ICR1 before the next edge */
+#if F_CPU != 16000000UL
+#error "The input capture receiver needs F_CPU = 16 MHz"
+#endif
+
+/* How long to wait for the response before giving up */
+#define ICP_TIMEOUT_US 400
+
+/* The response and the stop bit */
+#define ICP_EDGES (CONTROLLER_POLL_BITS + 1)
+
+static uint8_t controller_icp_edges[ICP_EDGES];
+/* Used by the capture interrupt */
+uint8_t *volatile controller_icp_ptr;
+volatile uint8_t controller_icp_left;
+
+void controller_icp_init(void)
+{
+    TCCR1A = 0;
+    /* Normal mode, no prescaler, capture on rising edge, noise canceler */
+    TCCR1B = (1<<ICNC1) | (1<<ICES1) | (1<<CS10);
+    TIMSK1 = 0;
+}
+
+/*
+ * Starts capturing the response. Must be called after the stop bit of the
+ * command, whose rising edge would otherwise be taken as the first bit.
+ */
+void controller_icp_start(void)
+{
+    controller_icp_ptr = controller_icp_edges;
+    controller_icp_left = ICP_EDGES;
+    TIFR1 = 1<<ICF1;
+    TIMSK1 = 1<<ICIE1;
+}
+
+/*
+ * Waits for the response started with controller_icp_start() and decodes
+ * it. Returns one of enum controller_status.
+ */
+uint8_t controller_icp_wait(void *report, uint8_t sz)
+{
+    uint16_t start;
+
+    start = TCNT3;
+    while (controller_icp_left) {
+        if ((uint16_t)(TCNT3 - start) > ICP_TIMEOUT_US * SCHED_TICKS_PER_US) {
+            TIMSK1 = 0;
+            if (controller_icp_left == ICP_EDGES)
+                return CONTROLLER_TIMEOUT;
+            return CONTROLLER_BAD_LENGTH;
+        }
+    }
+
+    return controller_decode_icp(controller_icp_edges, ICP_TICKS_PER_BIT,
+                                 report, sz);
+}
+
+/*
+ * Polls the controller on port 0. Only the command is sent with interrupts
+ * disabled, the response is received with them enabled.
+ */
+uint8_t controller_icp_poll(void *report, uint8_t sz)
+{
+    controller_send_poll(0);
+    controller_icp_start();
+    return controller_icp_wait(report, sz);
+}
+
+#endif
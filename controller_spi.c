@@ -0,0 +1,161 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "controller.h"
+#include "iodefs.h"
+#include "sched.h"
+
+#if CONTROLLER_SPI
+
+/*
+ * Hardware assisted command transmitter. Each Joybus bit is four SPI bits
+ * at 1 MHz, 0001 for a zero and 0111 for a one, so one SPI byte carries two
+ * Joybus bits. The bytes are fed from the transfer complete interrupt, so
+ * the other interrupts, USB included, keep running while the command goes
+ * out. The caller has nothing else to do in the meantime and just waits.
+ *
+ * MOSI (PB2) is push-pull, so it has to drive the data line through a
+ * diode, cathode towards MOSI. The line is still released by the pull-up
+ * when MOSI is high and received on the usual data pin.
+ *
+ * The gap between the bytes, the interrupt latency, falls on the high part
+ * of every second bit. Controllers only care about the length of the low
+ * part, so this just makes those bits slightly longer. A refill held up by
+ * another interrupt for more than SPI_GAP_MAX_US would stretch the bit
+ * enough to end the command, so the command is abandoned instead.
+ *
+ * The stop bit isn't sent with the SPI. SPIF only sets when the byte is
+ * over, 3 us after a stop bit nibble releases the line, and the receiver
+ * would start a few microseconds after that, when the controller may have
+ * started to answer 1 us after the release. Instead, the end of the last
+ * command bit is polled from SPIF with the interrupts disabled, and
+ * joybus_stop_rx() sends the stop bit with the data pin and starts the
+ * receiver right after releasing it. The time in between makes the high
+ * part of the last bit longer, like the gaps between the bytes.
+ */
+
+#define SPI_ZERO 0x1
+#define SPI_ONE 0x7
+
+/* Longest command and how long to wait for the transfer to finish */
+#define SPI_CMD_MAX 3
+#define SPI_TIMEOUT_US 600
+
+/* A byte takes 8 us, and the next one may come this much later */
+#define SPI_BYTE_US 8
+#define SPI_GAP_MAX_US 3
+#define SPI_REFILL_MAX_TICKS \
+    ((SPI_BYTE_US + SPI_GAP_MAX_US) * SCHED_TICKS_PER_US)
+
+/* The command bits, two per byte */
+static uint8_t spi_buf[SPI_CMD_MAX * 4];
+static const uint8_t *spi_ptr;
+static volatile uint8_t spi_left;
+/* TCNT3 when the byte being sent was written */
+static uint16_t spi_sent;
+static volatile uint8_t spi_late;
+
+void controller_spi_init(void)
+{
+    /* SS (PB0) is the LED2 output, so the SPI stays in master mode */
+    DDRB |= (1<<PB1) | (1<<PB2);
+    PORTB |= 1<<PB2;
+#if F_CPU == 16000000UL
+    SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR0); /* F_CPU / 16 */
+#else
+    SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR0); /* F_CPU / 8 with SPI2X */
+    SPSR = 1<<SPI2X;
+#endif
+
+    /* MOSI keeps the last bit sent, make sure it's high */
+    SPDR = 0xff;
+    while (!(SPSR & (1<<SPIF)))
+        ;
+}
+
+/* Returns the number of SPI bytes, the stop bit is left out */
+static uint8_t controller_spi_encode(const uint8_t *cmd, uint8_t len)
+{
+    uint8_t bits = len * 8;
+    uint8_t i, nibble;
+
+    for (i = 0; i < bits; ++i) {
+        nibble = cmd[i / 8] & (0x80>>(i & 7)) ? SPI_ONE : SPI_ZERO;
+        if (i & 1)
+            spi_buf[i / 2] |= nibble;
+        else
+            spi_buf[i / 2] = nibble<<4;
+    }
+
+    return bits / 2;
+}
+
+ISR(SPI_STC_vect)
+{
+    if ((uint16_t)(TCNT3 - spi_sent) > SPI_REFILL_MAX_TICKS) {
+        SPCR &= ~(1<<SPIE);
+        spi_late = 1;
+        spi_left = 0;
+        return;
+    }
+
+    SPDR = *spi_ptr++;
+    spi_sent = TCNT3;
+    if (!--spi_left)
+        SPCR &= ~(1<<SPIE);
+}
+
+/*
+ * Sends the poll command with the SPI and receives the response on port 0,
+ * with the input capture receiver if it's enabled. Returns one of enum
+ * controller_status.
+ */
+uint8_t controller_spi_poll(void *report, uint8_t sz)
+{
+    uint8_t cmd[JOYBUS_POLL_CMD_BYTES];
+    uint16_t start;
+    uint8_t len, status, sreg;
+
+    controller_poll_cmd(0, cmd);
+    len = controller_spi_encode(cmd, sizeof(cmd));
+    /* A poll that timed out may have left SPIF set */
+    (void)SPSR;
+    (void)SPDR;
+    spi_late = 0;
+    spi_ptr = spi_buf + 1;
+    spi_left = len - 1;
+    start = TCNT3;
+    SPDR = spi_buf[0];
+    spi_sent = start;
+    SPCR |= 1<<SPIE;
+
+    while (spi_left) {
+        if ((uint16_t)(TCNT3 - start) > SPI_TIMEOUT_US * SCHED_TICKS_PER_US) {
+            SPCR &= ~(1<<SPIE);
+            return CONTROLLER_TIMEOUT;
+        }
+    }
+    if (spi_late)
+        return CONTROLLER_TX_LATE;
+
+    /* The last byte is out at most SPI_BYTE_US from now */
+    sreg = SREG;
+    cli();
+    while (!(SPSR & (1<<SPIF)))
+        ;
+    (void)SPDR; /* Clears SPIF */
+#if CONTROLLER_ICP
+    /* Only the stop bit, whose rising edge mustn't be captured */
+    joybus_stop_rx(0, NULL, 0);
+    controller_icp_start();
+    SREG = sreg;
+    status = controller_icp_wait(report, sz);
+#else
+    status = controller_recv(0, report, sz);
+    SREG = sreg;
+#endif
+
+    return status;
+}
+
+#endif
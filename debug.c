@@ -1,12 +1,50 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 
+#include <stdarg.h>
 #include <stdio.h>
 
 #include "debug.h"
 #include "iodefs.h"
 
-#define BAUD 9600
+/*
+ * Everything written to the console goes through a ring buffer that the
+ * data register empty interrupt drains, so logging never waits for the
+ * USART. Must be a power of two, at most 128.
+ */
+#define DEBUG_BUF_SIZE 128
+
+#if DEBUG_BUF_SIZE & (DEBUG_BUF_SIZE - 1) || DEBUG_BUF_SIZE > 128
+#error "DEBUG_BUF_SIZE must be a power of two, at most 128"
+#endif
+
+static uint8_t debug_buf[DEBUG_BUF_SIZE];
+static volatile uint8_t debug_head;
+static volatile uint8_t debug_tail;
+
+#if !DEBUG_LOG_BINARY
+/*
+ * Text messages wait here unformatted until debug_poll(), so printf never
+ * runs in an interrupt handler and the characters of two messages can't get
+ * mixed. Must be a power of two.
+ */
+#define DEBUG_RECORDS 8
+
+#if DEBUG_LOG_ARGS_MAX != 4
+#error "debug_poll() passes four arguments"
+#endif
+
+struct debug_record {
+    const char *fmt;
+    unsigned int args[DEBUG_LOG_ARGS_MAX];
+};
+
+static struct debug_record debug_records[DEBUG_RECORDS];
+static volatile uint8_t debug_rec_head;
+static volatile uint8_t debug_rec_tail;
+/* Set by halt(), the console is written by polling */
+static uint8_t debug_sync;
+#endif
 
 void led_init(void)
 {
@@ -14,15 +52,78 @@ void led_init(void)
     DDR(LED2_BASE) |= 1<<LED2_PIN;
 }
 
-static int usart_putchar(char c, FILE *stream)
+#if DEBUG_LOG_BINARY
+/* Queues all of data or nothing, callable from any context */
+static void debug_write(const uint8_t *data, uint8_t sz)
 {
-    if (c == '\n')
-        usart_putchar('\r', stream);
+    uint8_t status, head;
 
-    while (!(UCSR1A & (1<<UDRE1)))
-        ;
+    status = SREG;
+    cli();
+    head = debug_head;
+    if ((uint8_t)(DEBUG_BUF_SIZE - (uint8_t)(head - debug_tail)) >= sz) {
+        while (sz--)
+            debug_buf[head++ & (DEBUG_BUF_SIZE - 1)] = *data++;
+        debug_head = head;
+        UCSR1B |= 1<<UDRIE1;
+    }
+    SREG = status;
+}
+#endif
 
-    UDR1 = c;
+/*
+ * Queues text with its newlines sent as CR LF, all of it or nothing, so a
+ * message that doesn't fit is dropped whole instead of cut off
+ */
+static void debug_write_text(const char *text, uint8_t len)
+{
+    uint8_t status, head, sz = len, i;
+
+    for (i = 0; i < len; ++i) {
+        if (text[i] == '\n')
+            ++sz;
+    }
+
+    status = SREG;
+    cli();
+    head = debug_head;
+    if ((uint8_t)(DEBUG_BUF_SIZE - (uint8_t)(head - debug_tail)) >= sz) {
+        while (len--) {
+            if (*text == '\n')
+                debug_buf[head++ & (DEBUG_BUF_SIZE - 1)] = '\r';
+            debug_buf[head++ & (DEBUG_BUF_SIZE - 1)] = *text++;
+        }
+        debug_head = head;
+        UCSR1B |= 1<<UDRIE1;
+    }
+    SREG = status;
+}
+
+ISR(USART1_UDRE_vect)
+{
+    uint8_t tail = debug_tail;
+
+    if (tail == debug_head) {
+        UCSR1B &= ~(1<<UDRIE1);
+        return;
+    }
+    UDR1 = debug_buf[tail & (DEBUG_BUF_SIZE - 1)];
+    debug_tail = tail + 1;
+}
+
+static void usart_write_sync(uint8_t c);
+
+static int usart_putchar(char c, FILE *stream)
+{
+#if !DEBUG_LOG_BINARY
+    if (debug_sync) {
+        if (c == '\n')
+            usart_write_sync('\r');
+        usart_write_sync(c);
+        return 0;
+    }
+#endif
+    debug_write_text(&c, 1);
 
     return 0;
 }
@@ -39,15 +140,15 @@ static FILE mystdin = FDEV_SETUP_STREAM(NULL, usart_getchar, _FDEV_SETUP_READ);
 
 void usart_init(void)
 {
-    const uint16_t ubbr = 2000000UL / (2 * BAUD) - 1;
-
-    UBRR1H = ubbr >> 8;
-    UBRR1L = ubbr;
+    UBRR1H = DEBUG_UBRR >> 8;
+    UBRR1L = DEBUG_UBRR & 0xff;
+    UCSR1A = 1<<U2X1;
     UCSR1B = (1<<RXEN1) | (1<<TXEN1);
     /* 8 data bits, 1 stop bit */
     UCSR1C = (1<<UCSZ11) | (1<<UCSZ10);
 
-    DDRD |= 1<<1;
+    /* TXD1 */
+    DDRD |= 1<<3;
 
     usart_putchar('A', NULL);
     usart_putchar('\n', NULL);
@@ -59,11 +160,120 @@ void stdio_init(void)
     stdin = &mystdin;
 }
 
-void halt(void)
+void debug_log(const char *fmt, uint8_t n, ...)
 {
+    va_list ap;
+#if DEBUG_LOG_BINARY
+    uint8_t rec[3 + DEBUG_LOG_ARGS_MAX * 2];
+    uint8_t *p = rec;
+    unsigned int arg;
+
+    *p++ = 0x80 | n;
+    *p++ = (uint16_t)fmt;
+    *p++ = (uint16_t)fmt >> 8;
+    va_start(ap, n);
+    while (n--) {
+        arg = va_arg(ap, unsigned int);
+        *p++ = arg;
+        *p++ = arg >> 8;
+    }
+    va_end(ap);
+    debug_write(rec, p - rec);
+#else
+    struct debug_record *rec;
+    uint8_t status, head, i;
+
+    status = SREG;
     cli();
-    for (;;)
+    head = debug_rec_head;
+    if ((uint8_t)(head - debug_rec_tail) < DEBUG_RECORDS) {
+        rec = &debug_records[head & (DEBUG_RECORDS - 1)];
+        rec->fmt = fmt;
+        va_start(ap, n);
+        for (i = 0; i < n; ++i)
+            rec->args[i] = va_arg(ap, unsigned int);
+        va_end(ap);
+        debug_rec_head = head + 1;
+    }
+    SREG = status;
+#endif
+}
+
+/*
+ * Formats the queued text messages, from the main loop. Takes one message
+ * per call so a burst of them doesn't hold up the next poll. The message is
+ * formatted whole before it's queued, and one longer than the ring buffer is
+ * dropped.
+ */
+void debug_poll(void)
+{
+#if !DEBUG_LOG_BINARY
+    static char line[DEBUG_BUF_SIZE];
+    struct debug_record *rec;
+    uint8_t tail = debug_rec_tail;
+    uint8_t i;
+    int len;
+
+    if (tail == debug_rec_head)
+        return;
+    rec = &debug_records[tail & (DEBUG_RECORDS - 1)];
+    /* Unused arguments are ignored by printf */
+    len = snprintf_P(line, sizeof(line), rec->fmt, rec->args[0],
+                     rec->args[1], rec->args[2], rec->args[3]);
+    debug_rec_tail = tail + 1;
+    if (len < 0 || len >= (int)sizeof(line))
+        return;
+
+    if (debug_sync) {
+        for (i = 0; i < len; ++i)
+            usart_putchar(line[i], NULL);
+    } else {
+        debug_write_text(line, len);
+    }
+#endif
+}
+
+static void usart_write_sync(uint8_t c)
+{
+    while (!(UCSR1A & (1<<UDRE1)))
         ;
+    UDR1 = c;
 }
 
+/* Sends out the queued bytes by polling, interrupts must be disabled */
+static void debug_flush(void)
+{
+    while (debug_tail != debug_head)
+        usart_write_sync(debug_buf[debug_tail++ & (DEBUG_BUF_SIZE - 1)]);
+}
+
+/*
+ * Writes a character after everything that's queued, waiting for the USART.
+ * Only for fatal error paths.
+ */
+void debug_putc_sync(char c)
+{
+    uint8_t status;
+
+    status = SREG;
+    cli();
+    debug_flush();
+    if (c == '\n')
+        usart_write_sync('\r');
+    usart_write_sync(c);
+    SREG = status;
+}
 
+/* Lets the queued messages out before stopping */
+void halt(void)
+{
+    cli();
+    debug_flush();
+#if !DEBUG_LOG_BINARY
+    debug_sync = 1;
+    while (debug_rec_tail != debug_rec_head)
+        debug_poll();
+#endif
+    for (;;)
+        ;
+}
@@ -1,9 +1,69 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* Serial console baud rate */
+#ifndef DEBUG_BAUD
+#if F_CPU == 8000000UL
+#define DEBUG_BAUD 38400
+#else
+#define DEBUG_BAUD 115200
+#endif
+#endif
+
+/* Double speed mode, rounded to the nearest divider */
+#define DEBUG_UBRR ((F_CPU / 4 / DEBUG_BAUD - 1) / 2)
+#define DEBUG_BAUD_REAL (F_CPU / 8 / (DEBUG_UBRR + 1))
+
+/*
+ * The adapter on the other end is assumed to be exact, which leaves about
+ * half of the 8N1 frame tolerance for ours. 115200 is 2.1% off at 16 MHz.
+ */
+#if DEBUG_BAUD_REAL * 1000 > DEBUG_BAUD * 1025 || \
+    DEBUG_BAUD_REAL * 1000 < DEBUG_BAUD * 975
+#error "DEBUG_BAUD is more than 2.5% off at this F_CPU"
+#endif
+
+/*
+ * Set to 1 to log binary records instead of text. A record is a header byte
+ * 0x80 | number of arguments, the flash address of the format string and the
+ * arguments, all little endian 16 bit. Text is always below 0x80, so the two
+ * can be told apart on the line.
+ */
+#ifndef DEBUG_LOG_BINARY
+#define DEBUG_LOG_BINARY 0
+#endif
+
+#define DEBUG_LOG_ARGS_MAX 4
+
+/* Counts up to 8 arguments, so that a few too many are still caught */
+#define DEBUG_NARGS(...) \
+    DEBUG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define DEBUG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+/* Zero, or the size of an array of negative size if n is too many arguments */
+#define DEBUG_NARGS_CHECK(n) \
+    (0 * sizeof(char [(n) <= DEBUG_LOG_ARGS_MAX ? 1 : -1]))
+
+/*
+ * Logs a message from any context without blocking. The format string stays
+ * in flash and at most DEBUG_LOG_ARGS_MAX arguments are allowed, each of
+ * which is passed as an unsigned int. More don't compile. The message is
+ * dropped if it doesn't fit in the buffer. Text messages are formatted later
+ * by debug_poll().
+ */
+#define DEBUG_LOG(fmt, ...) \
+    debug_log(PSTR(fmt), DEBUG_NARGS(__VA_ARGS__) + \
+              DEBUG_NARGS_CHECK(DEBUG_NARGS(__VA_ARGS__)), ##__VA_ARGS__)
+
 void led_init(void);
 void usart_init(void);
 void stdio_init(void);
+void debug_log(const char *fmt, uint8_t n, ...);
+void debug_poll(void);
+void debug_putc_sync(char c);
 void halt(void);
 
 #endif
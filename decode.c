@@ -0,0 +1,299 @@
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#endif
+
+#include "controller.h"
+#include "decode.h"
+
+#if CONTROLLER_RAW_SAMPLES
+/*
+ * A bit in the controller state is encoded into four bits. A byte received
+ * from the controller holds two original bits.
+ *
+ * The default receiver, joybus_rx, stores the bytes while receiving, this is
+ * only for the raw samples. One table lookup per sample byte makes 32 for a
+ * response, about 25 us at 16 MHz.
+ */
+
+/*
+ * In the correct case the middle bits should be the most important in
+ * determining the value of the encoded bit.
+ */
+#define ENC_WEIGHT(v) \
+    (((v) & 1) + (((v)>>1) & 1) * 2 + (((v)>>2) & 1) * 2 + (((v)>>3) & 1))
+
+#define ENC_DECODE(v) \
+    ((ENC_WEIGHT(v) > ENC_BIT_THRESHOLD) | \
+     ((ENC_WEIGHT((v)>>4) > ENC_BIT_THRESHOLD)<<1))
+
+/* The decode table is expanded from ENC_DECODE by the preprocessor */
+#define ENC_DECODE4(v) \
+    ENC_DECODE(v), ENC_DECODE((v) + 1), ENC_DECODE((v) + 2), ENC_DECODE((v) + 3)
+#define ENC_DECODE16(v) \
+    ENC_DECODE4(v), ENC_DECODE4((v) + 4), \
+    ENC_DECODE4((v) + 8), ENC_DECODE4((v) + 12)
+#define ENC_DECODE64(v) \
+    ENC_DECODE16(v), ENC_DECODE16((v) + 16), \
+    ENC_DECODE16((v) + 32), ENC_DECODE16((v) + 48)
+
+static const uint8_t controller_decode_table[256] PROGMEM = {
+    ENC_DECODE64(0), ENC_DECODE64(64), ENC_DECODE64(128), ENC_DECODE64(192)
+};
+
+static inline uint8_t controller_decode_byte(uint8_t v)
+{
+    return pgm_read_byte(&controller_decode_table[v]);
+}
+
+void controller_decode_state(const uint8_t *buf, uint8_t *report, uint8_t len)
+{
+    uint8_t byte;
+
+    while (len--) {
+        byte = controller_decode_byte(*buf++)<<6;
+        byte |= controller_decode_byte(*buf++)<<4;
+        byte |= controller_decode_byte(*buf++)<<2;
+        byte |= controller_decode_byte(*buf++);
+        *report++ = byte;
+    }
+}
+#endif
+
+/*
+ * Collects the response of one port from the bit sliced response. Each
+ * slice holds one response bit of every port.
+ */
+void controller_unslice(const uint8_t *slices, uint8_t bit,
+                        uint8_t *report, uint8_t len)
+{
+    uint8_t mask = 1<<bit;
+    uint8_t byte, i;
+
+    while (len--) {
+        byte = 0;
+        for (i = 0; i < 8; ++i) {
+            byte <<= 1;
+            if (*slices++ & mask)
+                byte |= 1;
+        }
+        *report++ = byte;
+    }
+}
+
+/*
+ * Decodes the response from the distances of its rising edges, see
+ * controller_icp.c. The edges are timestamps in timer ticks and bit_time is
+ * the nominal bit time in the same ticks. Bits past sz bytes are decoded but
+ * not stored. Returns -1 if the edges don't make up a valid response, else
+ * the last bit.
+ */
+int8_t controller_decode_edges(const uint8_t *edges, uint8_t n,
+                               uint8_t bit_time, uint8_t *report, uint8_t sz)
+{
+    uint8_t i, d, bit = 0, byte = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (i) {
+            d = edges[i] - edges[i - 1];
+            if (d < bit_time - bit_time / 4) {
+                /* Zero to one */
+                if (bit)
+                    return -1;
+                bit = 1;
+            } else if (d > bit_time + bit_time / 4) {
+                /* One to zero */
+                if (!bit)
+                    return -1;
+                bit = 0;
+            } else {
+                bit_time = (3 * bit_time + d) / 4;
+            }
+        }
+
+        byte = (byte<<1) | bit;
+        if ((i & 7) == 7 && sz) {
+            --sz;
+            *report++ = byte;
+        }
+    }
+
+    return bit;
+}
+
+/*
+ * Checks and decodes the CONTROLLER_POLL_BITS + 1 rising edges of a poll
+ * response and its stop bit. The last bit has to be a one and the first
+ * and the last edge have to be 63.5 bit times apart, give or take
+ * CONTROLLER_ICP_SPAN_SLACK bits. Returns one of enum controller_status.
+ */
+uint8_t controller_decode_icp(const uint8_t *edges, uint8_t bit_time,
+                              uint8_t *report, uint8_t sz)
+{
+    uint16_t span = 0, nominal = 127 * bit_time / 2;
+    uint8_t i;
+    int8_t last;
+
+    /* The low bytes wrap, but no single distance does */
+    for (i = 1; i < CONTROLLER_POLL_BITS + 1; ++i)
+        span += (uint8_t)(edges[i] - edges[i - 1]);
+    if (span < nominal - CONTROLLER_ICP_SPAN_SLACK * bit_time ||
+        span > nominal + CONTROLLER_ICP_SPAN_SLACK * bit_time)
+        return CONTROLLER_BAD_LENGTH;
+
+    last = controller_decode_edges(edges, CONTROLLER_POLL_BITS + 1, bit_time,
+                                   report, sz);
+    if (last < 0)
+        return CONTROLLER_BAD_BITS;
+    if (!last)
+        return CONTROLLER_BAD_STOP;
+
+    return CONTROLLER_OK;
+}
+
+/*
+ * Checks the bits of a poll response that are the same in every mode: the
+ * first two bits are zero and the first bit of the second byte is one.
+ * Returns nonzero if they are wrong.
+ */
+int8_t joypad_response_check(const uint8_t *resp)
+{
+    if ((resp[0] & 0xc0) || !(resp[1] & 0x80))
+        return -1;
+    return 0;
+}
+
+/* The 4 bit fields are the high bits of the full resolution value */
+#define NIBBLE_HI(v) ((v) & 0xf0)
+#define NIBBLE_LO(v) ((uint8_t)((v)<<4))
+
+/*
+ * Unpacks the 8 byte poll response of an analog mode. The sticks are always
+ * full resolution, the rest of the bytes are split differently by each mode.
+ * The fields missing from a mode are zero.
+ */
+void joypad_response_unpack(struct joypad_report *report, const uint8_t *resp,
+                            uint8_t mode)
+{
+    report->buttons_0 = resp[0];
+    report->buttons_1 = resp[1];
+    report->joy_x = resp[2];
+    report->joy_y = resp[3];
+
+    switch (mode) {
+        case 0:
+        report->c_x = resp[4];
+        report->c_y = resp[5];
+        report->l = NIBBLE_HI(resp[6]);
+        report->r = NIBBLE_LO(resp[6]);
+        report->a = NIBBLE_HI(resp[7]);
+        report->b = NIBBLE_LO(resp[7]);
+        break;
+
+        case 1:
+        report->c_x = NIBBLE_HI(resp[4]);
+        report->c_y = NIBBLE_LO(resp[4]);
+        report->l = resp[5];
+        report->r = resp[6];
+        report->a = NIBBLE_HI(resp[7]);
+        report->b = NIBBLE_LO(resp[7]);
+        break;
+
+        case 2:
+        report->c_x = NIBBLE_HI(resp[4]);
+        report->c_y = NIBBLE_LO(resp[4]);
+        report->l = NIBBLE_HI(resp[5]);
+        report->r = NIBBLE_LO(resp[5]);
+        report->a = resp[6];
+        report->b = resp[7];
+        break;
+
+        case 4:
+        report->c_x = resp[4];
+        report->c_y = resp[5];
+        report->l = 0;
+        report->r = 0;
+        report->a = resp[6];
+        report->b = resp[7];
+        break;
+
+        default:
+        report->c_x = resp[4];
+        report->c_y = resp[5];
+        report->l = resp[6];
+        report->r = resp[7];
+        report->a = 0;
+        report->b = 0;
+        break;
+    }
+}
+
+/*
+ * Builds the lookup table of a stick axis. The table is indexed with the
+ * distance from the origin as an unsigned byte and gives the signed HID
+ * value. Distances up to deadzone give zero, the rest are scaled linearly so
+ * that range gives full deflection. range must be above deadzone. The Y axes
+ * are flipped because the controller reports up as positive.
+ */
+void stick_lut_build(uint8_t *lut, uint8_t deadzone, uint8_t range,
+                     uint8_t flip)
+{
+    uint16_t v;
+    uint8_t a;
+    uint8_t i = 0;
+
+    do {
+        a = (i & 0x80) ? -i : i;
+        if (a <= deadzone)
+            v = 0;
+        else
+            v = (uint16_t)(a - deadzone) * 127 / (range - deadzone);
+        if (v > 127)
+            v = 127;
+        if (!(i & 0x80) != !flip)
+            v = -v;
+        lut[i] = v;
+    } while (++i);
+}
+
+/*
+ * The distance of a stick axis from its origin as the index of its lookup
+ * table. With an origin off the centre the distance can be over 127 either
+ * way, which would wrap to the other side, so it's clamped.
+ */
+static inline uint8_t stick_deflection(uint8_t v, uint8_t origin)
+{
+    int16_t d = (int16_t)v - origin;
+
+    if (d > 127)
+        d = 127;
+    else if (d < -128)
+        d = -128;
+    return d;
+}
+
+/*
+ * The decoded packet from the controller is used as the HID report. The HID
+ * report descriptor specifies the field order and padding identitcal to the
+ * decoded controller packet. The stick axes go through the calibration
+ * tables relative to the origin of the controller, and the triggers are
+ * offset by their origin. The analog A and B are passed as is.
+ */
+void joypad_report_transform(struct joypad_report *dst,
+                             const struct joypad_report *src,
+                             const struct joypad_report *origin,
+                             const uint8_t (*luts)[256])
+{
+    dst->buttons_0 = src->buttons_0;
+    dst->buttons_1 = src->buttons_1;
+    dst->joy_x = luts[0][stick_deflection(src->joy_x, origin->joy_x)];
+    dst->joy_y = luts[1][stick_deflection(src->joy_y, origin->joy_y)];
+    dst->c_x = luts[2][stick_deflection(src->c_x, origin->c_x)];
+    dst->c_y = luts[3][stick_deflection(src->c_y, origin->c_y)];
+    dst->l = src->l > origin->l ? src->l - origin->l : 0;
+    dst->r = src->r > origin->r ? src->r - origin->r : 0;
+    dst->a = src->a;
+    dst->b = src->b;
+}
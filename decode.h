@@ -0,0 +1,44 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+
+#include "report.h"
+
+/*
+ * Decoding of the controller responses. Nothing here touches the hardware so
+ * the code can also be compiled for the host.
+ */
+
+void controller_decode_state(const uint8_t *buf, uint8_t *report,
+                             uint8_t len);
+void controller_unslice(const uint8_t *slices, uint8_t bit,
+                        uint8_t *report, uint8_t len);
+int8_t controller_decode_edges(const uint8_t *edges, uint8_t n,
+                               uint8_t bit_time, uint8_t *report, uint8_t sz);
+
+/*
+ * A response has 63.5 bit times between its first rising edge and the one
+ * of the stop bit. A controller clock 6% off or one bit too many or too few
+ * stays within the slack, a capture that lost track doesn't.
+ */
+#define CONTROLLER_ICP_SPAN_SLACK 4
+
+uint8_t controller_decode_icp(const uint8_t *edges, uint8_t bit_time,
+                              uint8_t *report, uint8_t sz);
+
+int8_t joypad_response_check(const uint8_t *resp);
+void joypad_response_unpack(struct joypad_report *report, const uint8_t *resp,
+                            uint8_t mode);
+
+/* joy_x, joy_y, c_x and c_y, in the report order */
+#define STICK_AXES 4
+
+void stick_lut_build(uint8_t *lut, uint8_t deadzone, uint8_t range,
+                     uint8_t flip);
+void joypad_report_transform(struct joypad_report *dst,
+                             const struct joypad_report *src,
+                             const struct joypad_report *origin,
+                             const uint8_t (*luts)[256]);
+
+#endif
@@ -13,14 +13,48 @@
 #define LED2_BASE PINB
 #define LED2_PIN 0
 
+/* Number of controller ports, 1 to 4 */
+#ifndef CONTROLLER_PORTS
+#define CONTROLLER_PORTS 1
+#endif
+
+#if CONTROLLER_ICP && CONTROLLER_PORTS > 1
+#error "The input capture receiver supports only one port"
+#endif
+
+#if CONTROLLER_SPI && CONTROLLER_PORTS > 1
+#error "The SPI transmitter supports only one port"
+#endif
+
+/*
+ * The raw samples receiver polls the ports one by one, about 435 us each with
+ * the decode, and the poll must end before the next SOF, see RAW_POLL_US
+ */
+#if CONTROLLER_RAW_SAMPLES && CONTROLLER_PORTS > 2
+#error "The raw samples receiver fits only two ports in a frame"
+#endif
+
 /* These macros need to also work with the assembler */
 #define CONTROLLER_DATA_PIN PIND
 #define CONTROLLER_DATA_PORT PORTD
 #define CONTROLLER_DATA_DDR DDRD
 /*
- * This must be zero because the shifts in the polling code assume that the
- * data is in the first bit
+ * All the data lines are in the same port, one bit per controller port.
+ * The input capture receiver needs the line on ICP1 (PD4).
  */
-#define CONTROLLER_DATA_BIT 0
+#if CONTROLLER_ICP
+#define CONTROLLER_DATA_BIT0 4
+#else
+#define CONTROLLER_DATA_BIT0 0
+#endif
+#define CONTROLLER_DATA_BIT1 1
+#define CONTROLLER_DATA_BIT2 6
+#define CONTROLLER_DATA_BIT3 7
+
+#define CONTROLLER_DATA_MASK \
+    ((1<<CONTROLLER_DATA_BIT0) | \
+     ((CONTROLLER_PORTS > 1)<<CONTROLLER_DATA_BIT1) | \
+     ((CONTROLLER_PORTS > 2)<<CONTROLLER_DATA_BIT2) | \
+     ((CONTROLLER_PORTS > 3)<<CONTROLLER_DATA_BIT3))
 
 #endif
@@ -1,17 +1,81 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 #include <util/delay.h>
-#include <stdio.h>
+#include <string.h>
 
 #include "debug.h"
 #include "usb.h"
+#include "calib.h"
 #include "controller.h"
+#include "decode.h"
 #include "iodefs.h"
+#include "sched.h"
+#include "trace.h"
 
 #define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/*
+ * With REPORT_ON_CHANGE only reports that differ from the last sent one are
+ * sent, plus one every REPORT_KEEPALIVE_MS.
+ */
+#ifndef REPORT_ON_CHANGE
+#define REPORT_ON_CHANGE 1
+#endif
+#ifndef REPORT_KEEPALIVE_MS
+#define REPORT_KEEPALIVE_MS 100
+#endif
+#ifndef REPORT_STICK_THRESHOLD
+#define REPORT_STICK_THRESHOLD 0
+#endif
+#ifndef REPORT_TRIGGER_THRESHOLD
+#define REPORT_TRIGGER_THRESHOLD 0
+#endif
+
+#if REPORT_KEEPALIVE_MS < 1 || REPORT_KEEPALIVE_MS > 255
+#error "REPORT_KEEPALIVE_MS must be between 1 and 255"
+#endif
+
+/*
+ * With REMOTE_WAKEUP the controllers are polled every 64 ms while the bus is
+ * suspended, and a button press wakes the host if it has allowed it
+ */
+#ifndef REMOTE_WAKEUP
+#define REMOTE_WAKEUP 0
+#endif
+/* Watchdog interrupt interval while suspended, 64 ms */
+#define REMOTE_WAKEUP_WDP (1<<WDP1)
+
 static volatile uint8_t usb_configuration = 0;
+/* Set from the suspend interrupt until the bus wakes up */
+static volatile uint8_t usb_suspended;
+#if REMOTE_WAKEUP
+/* Set and cleared by the host with the DEVICE_REMOTE_WAKEUP feature */
+static volatile uint8_t usb_remote_wakeup;
+#endif
+
+static struct power_stats {
+    uint16_t suspends;
+    uint16_t resumes;
+    uint16_t remote_wakeups;
+} power_stats;
+
+/* The PLL wants an 8 MHz input */
+static void usb_pll_start(void)
+{
+#if F_CPU == 16000000UL
+    PLLCSR = (1<<PINDIV) | (1<<PLLE); /* Set PLL prescaler, enable the PLL */
+#else
+    PLLCSR = 1<<PLLE;
+#endif
+
+    /* Wait for PLL to lock */
+    while (!(PLLCSR & (1<<PLOCK)))
+        ;
+}
 
 static void usb_init(void)
 {
@@ -19,12 +83,7 @@ static void usb_init(void)
     UHWCON = (1<<UVREGE); /* Enable USB pad regulator */
     /* USB freeze */
     USBCON = (1<<USBE) | (1<<FRZCLK); /* Enable USB controller, freeze USB clock */
-    /* PLL config */
-    PLLCSR = (1<<PINDIV) | (1<<PLLE); /* Set PLL prescaler, enable the PLL */
-
-    /* Wait for PLL to lock */
-    while (!(PLLCSR) & (1<<PLOCK))
-        ;
+    usb_pll_start();
 
     /* USB config */
     USBCON = (1<<USBE) | (1<<OTGPADE);
@@ -32,15 +91,25 @@ static void usb_init(void)
     UDCON &= ~(1<<DETACH);
 
     usb_configuration = 0;
+    usb_suspended = 0;
 
     /* Enable interrupts */
-    UDIEN = (1<<EORSTE) | (1<<SOFE);
+    UDIEN = (1<<EORSTE) | (1<<SOFE) | (1<<SUSPE);
     sei();
 }
 
-#define GAMEPAD_INTERFACE 0
-#define GAMEPAD_EP_SIZE 8
-#define GAMEPAD_EP 3
+/* Each controller port is a HID interface with its own IN endpoint */
+#define GAMEPAD_INTERFACE(port) (port)
+#define GAMEPAD_EP_SIZE 16
+#define GAMEPAD_EP(port) (3 + (port))
+
+#define GAMEPAD_EP_CFG(port) \
+    [GAMEPAD_EP(port)] = { \
+        .ueconx     = 1<<EPEN, \
+        .uecfg0x    =  (USB_EP_TYPE_INTERRUPT<<EPTYPE0) | (1<<EPDIR), \
+        /* The endpoint size is 16 */ \
+        .uecfg1x    = (1<<EPSIZE0) | (1<<EPBK0) | (1<<ALLOC), \
+    }
 
 static const struct usb_ep_cfg {
     uint8_t ueconx;
@@ -52,15 +121,19 @@ static const struct usb_ep_cfg {
         .uecfg0x = USB_EP_TYPE_CONTROL<<EPTYPE0,
         .uecfg1x = (1<<EPSIZE1) | (1<<ALLOC),
     },
-    [GAMEPAD_EP] = {
-        .ueconx     = 1<<EPEN,
-        .uecfg0x    =  (USB_EP_TYPE_INTERRUPT<<EPTYPE0) | (1<<EPDIR),
-        /* The endpoint size is 8, so the EPSIZE bits are zero and omited */
-        .uecfg1x    = (1<<EPBK0) | (1<<ALLOC),
-    },
+    GAMEPAD_EP_CFG(0),
+#if CONTROLLER_PORTS > 1
+    GAMEPAD_EP_CFG(1),
+#endif
+#if CONTROLLER_PORTS > 2
+    GAMEPAD_EP_CFG(2),
+#endif
+#if CONTROLLER_PORTS > 3
+    GAMEPAD_EP_CFG(3),
+#endif
 };
 
-static const uint8_t joypad_report_desc[] = {
+static const uint8_t joypad_report_desc[] PROGMEM = {
     USAGE_PAGE(GENERIC_DESKTOP)
     USAGE(GAME_PAD)
     COLLECTION(APPLICATION)
@@ -115,29 +188,128 @@ static const uint8_t joypad_report_desc[] = {
             REPORT_COUNT(2)
             INPUT(DATA, VARIABLE, ABSOLUTE)
 
-            /* The throtles */
+            /* The throtles and the analog A and B */
             USAGE_PAGE(GENERIC_DESKTOP)
             USAGE(RY)
             USAGE(RZ)
+            USAGE(SLIDER)
+            USAGE(DIAL)
             LOGICAL_MINIMUM(0)
-            LOGICAL_MAXIMUM(255)
+            LOGICAL_MAXIMUM16(255)
             REPORT_SIZE(8)
-            REPORT_COUNT(2)
+            REPORT_COUNT(4)
             INPUT(DATA, VARIABLE, ABSOLUTE)
         END_COLLECTION
+
+        /* Stick calibration, struct calib */
+        USAGE_PAGE_VENDOR
+        USAGE(0x01)
+        LOGICAL_MINIMUM(0)
+        LOGICAL_MAXIMUM(127)
+        REPORT_SIZE(8)
+        REPORT_COUNT(sizeof(struct calib))
+        FEATURE(DATA, VARIABLE, ABSOLUTE)
+
+        /*
+         * Rumble motor on in bit 0. A PID force feedback report would need
+         * the effect blocks of the whole PID model for a single motor bit,
+         * so this is vendor defined and driven by tools/rumble.py.
+         */
+        USAGE(0x02)
+        LOGICAL_MINIMUM(0)
+        LOGICAL_MAXIMUM(1)
+        REPORT_SIZE(1)
+        REPORT_COUNT(1)
+        OUTPUT(DATA, VARIABLE, ABSOLUTE)
+        REPORT_SIZE(7)
+        OUTPUT(CONST, VARIABLE, ABSOLUTE)
     END_COLLECTION
 };
 
-static volatile struct joypad_report {
-    uint8_t buttons_0;
-    uint8_t buttons_1;
-    uint8_t joy_x;
-    uint8_t joy_y;
-    uint8_t c_x;
-    uint8_t c_y;
-    uint8_t l;
-    uint8_t r;
-} __attribute__((packed)) joypad_report;
+struct joypad_report_buf {
+    struct joypad_report report;
+    uint16_t seq;
+};
+
+/*
+ * A port is probed until a controller answers, with the wait between the
+ * probes doubling while nothing does. Its origin is then read, and it's
+ * polled every slot until it stops answering.
+ */
+enum joypad_state {
+    JOYPAD_ABSENT,
+    JOYPAD_ORIGIN,      /* Answered the probe, the origin is read next */
+    JOYPAD_CONNECTED,
+};
+
+/*
+ * Per port state. The report is double buffered. The main loop fills the
+ * staging buffer and publishes it by flipping report_idx, which is a single
+ * byte store, so the readers in the endpoint interrupt never see a half
+ * written report.
+ */
+static struct joypad {
+    struct joypad_report_buf reports[2];
+    volatile uint8_t report_idx;
+    uint16_t report_seq;
+    uint16_t sent_seq;
+    /* The endpoint banks were full on the last send */
+    uint8_t banks_full;
+#if REPORT_ON_CHANGE
+    struct joypad_report last_sent;
+    uint8_t last_frame;
+#endif
+    /* enum joypad_state, enum joybus_device and the probe response */
+    uint8_t state;
+    uint8_t device;
+    uint8_t id[JOYBUS_PROBE_BYTES];
+    /* Slots to the next probe, and the wait in ms after that one */
+    uint8_t probe_wait;
+    uint8_t probe_backoff;
+    /* Resting positions read with the origin command */
+    struct joypad_report origin;
+} joypads[CONTROLLER_PORTS];
+
+/*
+ * Ports whose endpoint had a bank freed while a report was waiting for it,
+ * set by the endpoint interrupt
+ */
+static volatile uint8_t joypad_bank_freed;
+
+/*
+ * Rumble state set by the output reports, one bit per port. The main loop
+ * puts it into the next poll command.
+ */
+static volatile uint8_t joypad_rumble;
+uint8_t controller_rumble;
+uint8_t controller_rumble_lines;
+
+/* Used until the origin has been read */
+static const struct joypad_report joypad_origin_default = {
+    .joy_x  = 128,
+    .joy_y  = 128,
+    .c_x    = 128,
+    .c_y    = 128,
+};
+
+static inline struct joypad_report *joypad_report_staging(struct joypad *joypad)
+{
+    return &joypad->reports[joypad->report_idx ^ 1].report;
+}
+
+static inline const struct joypad_report_buf *
+joypad_report_published(const struct joypad *joypad)
+{
+    return &joypad->reports[joypad->report_idx];
+}
+
+static inline void joypad_report_publish(struct joypad *joypad)
+{
+    joypad->reports[joypad->report_idx ^ 1].seq = ++joypad->report_seq;
+    /* The staging buffer must be complete before the index is flipped */
+    __asm__ __volatile__ ("" ::: "memory");
+    joypad->report_idx ^= 1;
+}
 
 enum string_descriptors {
     STRING_DESC_IDX_LANG,
@@ -145,8 +317,7 @@ enum string_descriptors {
     STRING_DESC_IDX_PROD,
 };
 
-/* TODO make this progmem */
-static const struct usb_device_descriptor device_descriptor = {
+static const struct usb_device_descriptor device_descriptor PROGMEM = {
     .length             = sizeof(struct usb_device_descriptor),
     .descriptor_type    = USB_DESC_TYPE_DEVICE,
     .bcd_usb            = 0x0002,
@@ -163,104 +334,95 @@ static const struct usb_device_descriptor device_descriptor = {
     .num_configurations = 1
 };
 
-static const struct usb_config_desc_final {
-    struct usb_config_desc config;
+struct usb_gamepad_desc {
     struct usb_interface_desc interface;
     struct usb_hid_interface_desc hid_interface_desc;
     struct usb_endpoint_desc endpoint_desc;
-} __attribute__((packed)) config_desc_final = {
+} __attribute__((packed));
+
+#define GAMEPAD_DESC(port) { \
+    .interface = { \
+        .length                 = sizeof(struct usb_interface_desc), \
+        .descriptor_type        = USB_DESC_TYPE_INTERFACE, \
+        .interface_number       = GAMEPAD_INTERFACE(port), \
+        .alternate_setting      = 0, \
+        .num_endpoints          = 1, \
+        .interface_class        = USB_HID_DEVICE_CLASS, \
+        .interface_sub_class    = 0, \
+        .interface_protocol     = 0, \
+        .interface_idx          = 0, \
+    }, \
+    .hid_interface_desc = { \
+        .length                 = sizeof(struct usb_hid_interface_desc), \
+        .descriptor_type        = USB_DESC_TYPE_HID, \
+        .bcd_hid                = 0x101, \
+        .country_code           = 0, \
+        .num_descriptors        = 1, \
+        .descriptor_class_type  = USB_DESC_TYPE_REPORT, \
+        .descriptor_length      = sizeof(joypad_report_desc), \
+    }, \
+    .endpoint_desc = { \
+        .length             = sizeof(struct usb_endpoint_desc), \
+        .descriptor_type    = USB_DESC_TYPE_ENDPOINT, \
+        /* 7th bit is set for IN EP */ \
+        .endpoint_address   = GAMEPAD_EP(port) | 1<<7, \
+        .attributes         = USB_EP_TYPE_INTERRUPT, \
+        .max_packet_size    = GAMEPAD_EP_SIZE, \
+        .interval           = REPORT_INTERVAL_MS, \
+    }, \
+}
+
+static const struct usb_config_desc_final {
+    struct usb_config_desc config;
+    struct usb_gamepad_desc gamepads[CONTROLLER_PORTS];
+} __attribute__((packed)) config_desc_final PROGMEM = {
     .config = {
         .length                 = sizeof(config_desc_final.config),
         .descriptor_type        = USB_DESC_TYPE_CONFIGURATION,
         .total_length           = sizeof(config_desc_final),
-        .num_interfaces         = 1,
+        .num_interfaces         = CONTROLLER_PORTS,
         .configuration_value    = 1,
         .configuration_idx      = 0,
         .attributes             = (1<<USB_CFG_ATTR_RESERVED) |
-                                  (1<<USB_CFG_ATTR_SELF_POWERED),
+                                  (1<<USB_CFG_ATTR_SELF_POWERED) |
+                                  (REMOTE_WAKEUP<<USB_CFG_ATTR_REMOTE_WAKEUP),
         .max_power              = 50
     },
-    .interface = {
-        .length                 = sizeof(config_desc_final.interface),
-        .descriptor_type        = USB_DESC_TYPE_INTERFACE,
-        .interface_number       = GAMEPAD_INTERFACE,
-        .alternate_setting      = 0,
-        .num_endpoints          = 1,
-        .interface_class        = USB_HID_DEVICE_CLASS,
-        .interface_sub_class    = 0,
-        .interface_protocol     = 0,
-        .interface_idx          = 0,
-    },
-    .hid_interface_desc = {
-        .length                 = sizeof(config_desc_final.hid_interface_desc),
-        .descriptor_type        = USB_DESC_TYPE_HID,
-        .bcd_hid                = 0x101,
-        .country_code           = 0,
-        .num_descriptors        = 1,
-        .descriptor_class_type  = USB_DESC_TYPE_REPORT,
-        .descriptor_length      = sizeof(joypad_report_desc),
-    },
-    .endpoint_desc = {
-        .length             = sizeof(config_desc_final.endpoint_desc),
-        .descriptor_type    = USB_DESC_TYPE_ENDPOINT,
-        .endpoint_address   = GAMEPAD_EP | 1<<7, /* 7th bit is set for IN EP */
-        .attributes         = USB_EP_TYPE_INTERRUPT,
-        .max_packet_size    = GAMEPAD_EP_SIZE,
-        .interval           = 0,
+    .gamepads = {
+        GAMEPAD_DESC(0),
+#if CONTROLLER_PORTS > 1
+        GAMEPAD_DESC(1),
+#endif
+#if CONTROLLER_PORTS > 2
+        GAMEPAD_DESC(2),
+#endif
+#if CONTROLLER_PORTS > 3
+        GAMEPAD_DESC(3),
+#endif
     },
 };
 
-USB_STRING_DESCRIPTOR(str_desc_lang, 0x0409); /* US English language code */
+USB_STRING_DESCRIPTOR(str_desc_lang, L"\x0409"); /* US English language code */
 USB_STRING_DESCRIPTOR(str_desc_manuf, L"lörs");
 USB_STRING_DESCRIPTOR(str_desc_prod, L"lärä");
 
-/* TODO make this progmem */
-static struct usb_descriptor {
-    uint16_t value;
-    uint16_t index;
+struct usb_descriptor {
     const void *data;
     uint8_t data_sz;
-} descriptors[] = {
-    {
-        .value      = USB_DESC_TYPE_DEVICE<<8, /* 0x0100 */
-        .index      = 0,
-        .data       = &device_descriptor,
-        .data_sz    = sizeof(device_descriptor)
-    }, {
-        .value      = USB_DESC_TYPE_CONFIGURATION<<8, /* 0x0200 */
-        .index      = 0,
-        .data       = &config_desc_final,
-        .data_sz    = sizeof(config_desc_final),
-    }, {
-        .value      = USB_DESC_TYPE_REPORT<<8,
-        .index      = GAMEPAD_INTERFACE,
-        .data       = joypad_report_desc,
-        .data_sz    = sizeof(joypad_report_desc),
-    }, {
-        .value      = USB_DESC_TYPE_STRING<<8 | STRING_DESC_IDX_LANG,
-        .index      = 0,
-        .data       = &str_desc_lang,
-        .data_sz    = sizeof(str_desc_lang),
-    }, {
-        .value      = USB_DESC_TYPE_STRING<<8 | STRING_DESC_IDX_PROD,
-        .index      = 0x0409,
-        .data       = &str_desc_prod,
-        .data_sz    = sizeof(str_desc_prod),
-    }, {
-        .value      = USB_DESC_TYPE_STRING<<8 | STRING_DESC_IDX_MANUF,
-        .index      = 0x0409,
-        .data       = &str_desc_manuf,
-        .data_sz    = sizeof(str_desc_manuf),
-    }, {
-        .value      = USB_DESC_TYPE_LAST,
-        .index      = 0,
-        .data       = NULL,
-        .data_sz    = 0,
-    },
+};
+
+#define USB_DESCRIPTOR(d) { .data = &(d), .data_sz = sizeof(d) }
+
+/* Indexed by the string descriptor index */
+static const struct usb_descriptor string_descriptors[] PROGMEM = {
+    [STRING_DESC_IDX_LANG]  = USB_DESCRIPTOR(str_desc_lang),
+    [STRING_DESC_IDX_MANUF] = USB_DESCRIPTOR(str_desc_manuf),
+    [STRING_DESC_IDX_PROD]  = USB_DESCRIPTOR(str_desc_prod),
 };
 
 static inline void usb_stall(void)
 {
+    trace_add(TRACE_STALL, UENUM, 0);
     UECONX = (1<<STALLRQ) | (1<<EPEN);
 }
 
@@ -303,6 +465,13 @@ static inline void usb_fifo_write_raw(const unsigned char *src, uint8_t sz)
         UEDATX = *(src++);
 }
 
+static inline void usb_fifo_write_raw_P(const unsigned char *src, uint8_t sz)
+{
+    while (sz--)
+        UEDATX = pgm_read_byte(src++);
+}
+
+/* Writes a control IN transfer from flash */
 static inline void usb_fifo_write_control(const unsigned char *src, size_t sz)
 {
     uint8_t i;
@@ -313,7 +482,7 @@ static inline void usb_fifo_write_control(const unsigned char *src, size_t sz)
         /* Fail if data remains */
         if (i & (1<<RXOUTI))
             return;
-        usb_fifo_write_raw(src, MIN(sz, 32));
+        usb_fifo_write_raw_P(src, MIN(sz, 32));
         src += MIN(sz, 32);
         i = MIN(sz, 32);
         usb_int_ack();
@@ -321,13 +490,74 @@ static inline void usb_fifo_write_control(const unsigned char *src, size_t sz)
     }
 }
 
+#if REMOTE_WAKEUP
+/* The watchdog only wakes the CPU from power down */
+EMPTY_INTERRUPT(WDT_vect);
+
+static void usb_wdt_set(uint8_t wdtcsr)
+{
+    wdt_reset();
+    MCUSR &= ~(1<<WDRF);
+    WDTCSR = (1<<WDCE) | (1<<WDE);
+    WDTCSR = wdtcsr;
+}
+#endif
+
+/*
+ * The bus has been idle for 3 ms. The USB clock is frozen and the PLL
+ * stopped until the wakeup interrupt, which works without them.
+ */
+static void usb_suspend(void)
+{
+    UDIEN = (UDIEN & ~(1<<SUSPE)) | (1<<WAKEUPE);
+    USBCON |= 1<<FRZCLK;
+    PLLCSR &= ~(1<<PLLE);
+    usb_suspended = 1;
+    joypad_rumble = 0;
+    ++power_stats.suspends;
+#if REMOTE_WAKEUP
+    if (usb_remote_wakeup)
+        usb_wdt_set((1<<WDIE) | REMOTE_WAKEUP_WDP);
+#endif
+}
+
+/* WAKEUPI can only be cleared with the clock running */
+static void usb_resume(void)
+{
+    usb_pll_start();
+    USBCON &= ~(1<<FRZCLK);
+    UDINT = ~((1<<WAKEUPI) | (1<<SUSPI));
+    UDIEN = (UDIEN & ~(1<<WAKEUPE)) | (1<<SUSPE);
+    usb_suspended = 0;
+#if REMOTE_WAKEUP
+    usb_wdt_set(0);
+#endif
+}
+
 /* Device interrupt */
 ISR(USB_GEN_vect)
 {
     uint8_t status;
 
-    status = UDINT;
-    UDINT = 0;
+    /*
+     * WAKEUPI is set by any bus activity, only the enabled ones count. Only
+     * those are cleared so that no flag set in between is lost. SUSPI is left
+     * set while suspended, RMWKUP only signals with it set, and usb_resume()
+     * clears it.
+     */
+    status = UDINT & UDIEN;
+    UDINT = ~(status & ~(1<<SUSPI));
+
+    if (status & ~(1<<SOFI))
+        trace_add(TRACE_UDINT, status, 0);
+
+    if (status & (1<<WAKEUPI)) {
+        usb_resume();
+        ++power_stats.resumes;
+    }
+
+    if (status & (1<<SUSPI))
+        usb_suspend();
 
     /* End of reset interrupt */
     if (status & (1<<EORSTI)) {
@@ -335,14 +565,22 @@ ISR(USB_GEN_vect)
         /* Enable received setup interrupt */
         UEIENX = (1<<RXSTPE);
         usb_configuration = 0;
+        joypad_rumble = 0;
+#if REMOTE_WAKEUP
+        usb_remote_wakeup = 0;
+#endif
     }
+
+    /* Start of frame interrupt */
+    if (status & (1<<SOFI))
+        sched_sof();
 }
 
 static inline void usb_req_clear_feature(struct usb_request *usb_req)
 {
     uint8_t i = usb_req->index & 0x7f;
 
-    if (i < 1 || i > 4)
+    if (i < 1 || i >= ARRAY_LEN(usb_ep_cfgs))
         return;
 
     usb_int_ack();
@@ -351,6 +589,19 @@ static inline void usb_req_clear_feature(struct usb_request *usb_req)
     usb_reset_endpoint(i);
 }
 
+#if REMOTE_WAKEUP
+/* The only device feature is the remote wakeup */
+static inline void usb_req_device_feature(struct usb_request *usb_req)
+{
+    if (usb_req->value != USB_FEATURE_DEVICE_REMOTE_WAKEUP) {
+        usb_stall();
+        return;
+    }
+    usb_remote_wakeup = usb_req->request == USB_REQ_SET_FEATURE;
+    usb_int_ack();
+}
+#endif
+
 static inline void usb_req_set_address(struct usb_request *usb_req)
 {
     usb_int_ack();
@@ -358,26 +609,60 @@ static inline void usb_req_set_address(struct usb_request *usb_req)
     UDADDR = usb_req->value | (1<<ADDEN);
 }
 
-static inline void usb_req_get_descriptor(struct usb_request *usb_req)
+/*
+ * Finds the descriptor by its type and index. All the descriptors are in
+ * flash.
+ */
+static inline int8_t usb_find_descriptor(const struct usb_request *usb_req,
+                                         struct usb_descriptor *desc)
 {
-    uint8_t len;
-    struct usb_descriptor *desc;
+    uint8_t idx = usb_req->value & 0xff;
 
-    /* Look for the matching descriptor */
-    for (desc = descriptors; desc->value != USB_DESC_TYPE_LAST; ++desc) {
-        if (usb_req->value == desc->value && usb_req->index == desc->index)
-            break;
+    switch (usb_req->value>>8) {
+        case USB_DESC_TYPE_DEVICE:
+        desc->data = &device_descriptor;
+        desc->data_sz = sizeof(device_descriptor);
+        return 0;
+
+        case USB_DESC_TYPE_CONFIGURATION:
+        if (idx != 0)
+            return -1;
+        desc->data = &config_desc_final;
+        desc->data_sz = sizeof(config_desc_final);
+        return 0;
+
+        case USB_DESC_TYPE_STRING:
+        if (idx >= ARRAY_LEN(string_descriptors))
+            return -1;
+        memcpy_P(desc, &string_descriptors[idx], sizeof(*desc));
+        return 0;
+
+        case USB_DESC_TYPE_REPORT:
+        /* All the interfaces share the same report descriptor */
+        if (usb_req->index >= CONTROLLER_PORTS)
+            return -1;
+        desc->data = joypad_report_desc;
+        desc->data_sz = sizeof(joypad_report_desc);
+        return 0;
     }
 
-    if (desc->value == USB_DESC_TYPE_LAST) {
+    return -1;
+}
+
+static inline void usb_req_get_descriptor(struct usb_request *usb_req)
+{
+    uint8_t len;
+    struct usb_descriptor desc;
+
+    if (usb_find_descriptor(usb_req, &desc)) {
         usb_stall();
-        printf("no descriptor found\n");
+        DEBUG_LOG("no descriptor found: 0x%04x\n", usb_req->value);
         return;
     }
 
     len = MIN(usb_req->length, 255);
-    len = MIN(len, desc->data_sz);
-    usb_fifo_write_control(desc->data, len);
+    len = MIN(len, desc.data_sz);
+    usb_fifo_write_control(desc.data, len);
 }
 
 static inline void usb_req_set_configuration(struct usb_request *usb_req)
@@ -402,25 +687,307 @@ static inline void usb_hid_req_set_idle(struct usb_request *usb_req)
     usb_int_ack();
 }
 
+#if REPORT_ON_CHANGE
+/*
+ * Axis changes smaller than or equal to the threshold are treated as noise.
+ * The order matches the axes in struct joypad_report, the first STICK_AXES
+ * are signed.
+ */
+static const uint8_t joypad_axis_thresholds[] = {
+    REPORT_STICK_THRESHOLD,     /* joy_x */
+    REPORT_STICK_THRESHOLD,     /* joy_y */
+    REPORT_STICK_THRESHOLD,     /* c_x */
+    REPORT_STICK_THRESHOLD,     /* c_y */
+    REPORT_TRIGGER_THRESHOLD,   /* l */
+    REPORT_TRIGGER_THRESHOLD,   /* r */
+    REPORT_TRIGGER_THRESHOLD,   /* a */
+    REPORT_TRIGGER_THRESHOLD,   /* b */
+};
+
+static uint8_t joypad_report_changed(const struct joypad *joypad,
+                                     const struct joypad_report *report)
+{
+    const struct joypad_report *last = &joypad->last_sent;
+    const uint8_t *a = &report->joy_x;
+    const uint8_t *b = &last->joy_x;
+    uint8_t i;
+    int16_t d;
+
+    if (report->buttons_0 != last->buttons_0 ||
+        report->buttons_1 != last->buttons_1)
+        return 1;
+
+    for (i = 0; i < ARRAY_LEN(joypad_axis_thresholds); ++i) {
+        /* Widened so that a full scale swing does not wrap to a small one */
+        if (i < STICK_AXES)
+            d = (int16_t)(int8_t)a[i] - (int8_t)b[i];
+        else
+            d = (int16_t)a[i] - b[i];
+        if (d < 0)
+            d = -d;
+        if (d > joypad_axis_thresholds[i])
+            return 1;
+    }
+
+    return 0;
+}
+#endif
+
+static struct report_stats {
+    uint16_t sent;
+    uint16_t suppressed;
+} report_stats;
+
+enum vendor_requests {
+    VENDOR_REQ_GET_REPORT_INTERVAL  = 0x01,
+    VENDOR_REQ_SET_REPORT_INTERVAL  = 0x02,
+    VENDOR_REQ_GET_REPORT_STATS     = 0x03,
+    VENDOR_REQ_GET_LATENCY_HIST     = 0x04,
+    VENDOR_REQ_RESET_LATENCY_HIST   = 0x05,
+    VENDOR_REQ_GET_TRACE            = 0x06,
+    VENDOR_REQ_CLEAR_TRACE          = 0x07,
+    VENDOR_REQ_GET_ANALOG_MODE      = 0x08,
+    VENDOR_REQ_SET_ANALOG_MODE      = 0x09,
+    VENDOR_REQ_GET_POLL_STATS       = 0x0a,
+    VENDOR_REQ_GET_DEVICES          = 0x0b,
+    VENDOR_REQ_GET_POWER_STATS      = 0x0c,
+};
+
+/* Polls by enum controller_status, and the retries of the failed ones */
+static struct poll_stats {
+    uint16_t polls[CONTROLLER_STATUSES];
+    uint16_t retries;
+} poll_stats;
+
+uint8_t controller_mode = ANALOG_MODE;
+/* Taken into use by the main loop between polls */
+static volatile uint8_t controller_mode_new = ANALOG_MODE;
+
+static inline void usb_vendor_req_get_analog_mode(struct usb_request *usb_req)
+{
+    usb_wait_in();
+    UEDATX = controller_mode_new;
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_set_analog_mode(struct usb_request *usb_req)
+{
+    if (usb_req->value > ANALOG_MODE_MAX) {
+        usb_stall();
+        return;
+    }
+    controller_mode_new = usb_req->value;
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_get_poll_stats(struct usb_request *usb_req)
+{
+    uint8_t len = MIN(usb_req->length, sizeof(poll_stats));
+
+    usb_wait_in();
+    usb_fifo_write_raw((void *)&poll_stats, len);
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_get_power_stats(struct usb_request *usb_req)
+{
+    uint8_t len = MIN(usb_req->length, sizeof(power_stats));
+
+    usb_wait_in();
+    usb_fifo_write_raw((void *)&power_stats, len);
+    usb_int_ack();
+}
+
+/* The device type and the probe response of each port */
+static inline void usb_vendor_req_get_devices(struct usb_request *usb_req)
+{
+    uint8_t devices[CONTROLLER_PORTS][1 + JOYBUS_PROBE_BYTES];
+    uint8_t len = MIN(usb_req->length, sizeof(devices));
+    uint8_t port;
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        devices[port][0] = joypads[port].device;
+        memcpy(&devices[port][1], joypads[port].id, JOYBUS_PROBE_BYTES);
+    }
+    usb_wait_in();
+    usb_fifo_write_raw((void *)devices, len);
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_get_report_interval(struct usb_request *usb_req)
+{
+    usb_wait_in();
+    UEDATX = sched_get_interval();
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_set_report_interval(struct usb_request *usb_req)
+{
+    if (sched_set_interval(usb_req->value)) {
+        usb_stall();
+        return;
+    }
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_get_report_stats(struct usb_request *usb_req)
+{
+    uint8_t len = MIN(usb_req->length, sizeof(report_stats));
+
+    usb_wait_in();
+    usb_fifo_write_raw((void *)&report_stats, len);
+    usb_int_ack();
+}
+
+#if LATENCY_STATS
+/* The stage is in wIndex, see enum sched_stage */
+static inline void usb_vendor_req_get_latency_hist(struct usb_request *usb_req)
+{
+    uint8_t len = MIN(usb_req->length,
+                      SCHED_HIST_BUCKETS * sizeof(uint16_t));
+
+    if (usb_req->index >= SCHED_STAGES) {
+        usb_stall();
+        return;
+    }
+
+    usb_wait_in();
+    usb_fifo_write_raw((void *)sched_hist(usb_req->index), len);
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_reset_latency_hist(struct usb_request *usb_req)
+{
+    sched_hist_reset();
+    usb_int_ack();
+}
+#endif
+
+#if USB_TRACE
+/*
+ * Reads the trace starting from the event in wIndex, oldest first. The trace
+ * stops at the first read so that it doesn't move while being read, and
+ * starts again when cleared.
+ */
+static inline void usb_vendor_req_get_trace(struct usb_request *usb_req)
+{
+    struct trace_event ev;
+    uint8_t i, len = MIN(usb_req->length, 32);
+
+    trace_freeze();
+
+    usb_wait_in();
+    for (i = 0; len >= sizeof(ev) && usb_req->index + i < TRACE_LEN &&
+                trace_read(usb_req->index + i, &ev); ++i) {
+        usb_fifo_write_raw((void *)&ev, sizeof(ev));
+        len -= sizeof(ev);
+    }
+    usb_int_ack();
+}
+
+static inline void usb_vendor_req_clear_trace(struct usb_request *usb_req)
+{
+    trace_clear();
+    usb_int_ack();
+}
+#endif
+
 static inline void usb_hid_req_get_report(struct usb_request *usb_req)
 {
+    const struct joypad_report_buf *buf;
+
+    if (usb_req->index >= CONTROLLER_PORTS) {
+        usb_stall();
+        return;
+    }
+
+    /* The calibration is shared by all the ports */
+    if (usb_req->value>>8 == USB_HID_REPORT_FEATURE) {
+        usb_wait_in();
+        usb_fifo_write_raw((void *)calib_get(),
+                           MIN(usb_req->length, sizeof(struct calib)));
+        usb_int_ack();
+        return;
+    }
+
+    buf = joypad_report_published(&joypads[usb_req->index]);
+
     usb_wait_in();
-    usb_fifo_write_raw((void *)&joypad_report, sizeof(joypad_report));
+    usb_fifo_write_raw((void *)&buf->report, sizeof(buf->report));
     usb_int_ack();
 }
 
+/* Reads the data stage of a control OUT request */
+static inline void usb_control_read(void *dest, uint8_t sz)
+{
+    while (!(UEINTX & (1<<RXOUTI)))
+        ;
+    usb_fifo_read(dest, sz);
+    UEINTX = ~(1<<RXOUTI);
+}
+
+/*
+ * The output report is the rumble of the port in wIndex, the feature report
+ * the calibration.
+ */
+static inline void usb_hid_req_set_report(struct usb_request *usb_req)
+{
+    struct calib calib;
+    uint8_t rumble;
+
+    switch (usb_req->value>>8) {
+        case USB_HID_REPORT_OUTPUT:
+        if (usb_req->index >= CONTROLLER_PORTS ||
+            usb_req->length != sizeof(rumble))
+            break;
+        usb_control_read(&rumble, sizeof(rumble));
+        if (rumble & 1)
+            joypad_rumble |= 1<<usb_req->index;
+        else
+            joypad_rumble &= ~(1<<usb_req->index);
+        /* Status stage */
+        usb_wait_in();
+        usb_int_ack();
+        return;
+
+        case USB_HID_REPORT_FEATURE:
+        if (usb_req->length != sizeof(calib))
+            break;
+        usb_control_read(&calib, sizeof(calib));
+        if (calib_set(&calib))
+            break;
+        usb_wait_in();
+        usb_int_ack();
+        return;
+    }
+
+    usb_stall();
+}
+
 /* Endpoint interrupt */
 ISR(USB_COM_vect)
 {
-    uint8_t status;
+    uint8_t status, port;
     static struct usb_request usb_req;
 
+    /* The host took a report from a full endpoint, see usb_joypad_send() */
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (!(UEINT & (1<<GAMEPAD_EP(port))))
+            continue;
+        UENUM = GAMEPAD_EP(port);
+        UEIENX = 0;
+        joypad_bank_freed |= 1<<port;
+    }
+
     UENUM = 0;
     status = UEINTX;
 
     /* SETUP packet received  */
     if (status & (1<<RXSTPI)) {
         usb_fifo_read((void *)&usb_req, sizeof(usb_req));
+        trace_add(TRACE_SETUP, usb_req.request_type | usb_req.request<<8,
+                  usb_req.value);
+        trace_add(TRACE_SETUP_DATA, usb_req.index, usb_req.length);
         /* ACK the SETUP packet */
         UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
 
@@ -434,6 +1001,13 @@ ISR(USB_COM_vect)
                 case USB_REQ_SET_CONFIGURATION:
                 usb_req_set_configuration(&usb_req);
                 return;
+#if REMOTE_WAKEUP
+
+                case USB_REQ_SET_FEATURE:
+                case USB_REQ_CLEAR_FEATURE:
+                usb_req_device_feature(&usb_req);
+                return;
+#endif
             }
             case 0x01:
             case 0x02:
@@ -447,6 +1021,10 @@ ISR(USB_COM_vect)
                 case USB_HID_SET_IDLE:
                 usb_hid_req_set_idle(&usb_req);
                 return;
+
+                case USB_HID_SET_REPORT:
+                usb_hid_req_set_report(&usb_req);
+                return;
             }
             case 0x80:
             case 0x81:
@@ -461,136 +1039,627 @@ ISR(USB_COM_vect)
                 usb_hid_req_get_report(&usb_req);
                 return;
             }
+            break;
+            case 0x40:
+            switch (usb_req.request) {
+                case VENDOR_REQ_SET_REPORT_INTERVAL:
+                usb_vendor_req_set_report_interval(&usb_req);
+                return;
+
+                case VENDOR_REQ_SET_ANALOG_MODE:
+                usb_vendor_req_set_analog_mode(&usb_req);
+                return;
+#if LATENCY_STATS
+
+                case VENDOR_REQ_RESET_LATENCY_HIST:
+                usb_vendor_req_reset_latency_hist(&usb_req);
+                return;
+#endif
+#if USB_TRACE
+
+                case VENDOR_REQ_CLEAR_TRACE:
+                usb_vendor_req_clear_trace(&usb_req);
+                return;
+#endif
+            }
+            break;
+            case 0xc0:
+            switch (usb_req.request) {
+                case VENDOR_REQ_GET_REPORT_INTERVAL:
+                usb_vendor_req_get_report_interval(&usb_req);
+                return;
+
+                case VENDOR_REQ_GET_REPORT_STATS:
+                usb_vendor_req_get_report_stats(&usb_req);
+                return;
+
+                case VENDOR_REQ_GET_ANALOG_MODE:
+                usb_vendor_req_get_analog_mode(&usb_req);
+                return;
+
+                case VENDOR_REQ_GET_POLL_STATS:
+                usb_vendor_req_get_poll_stats(&usb_req);
+                return;
+
+                case VENDOR_REQ_GET_DEVICES:
+                usb_vendor_req_get_devices(&usb_req);
+                return;
+
+                case VENDOR_REQ_GET_POWER_STATS:
+                usb_vendor_req_get_power_stats(&usb_req);
+                return;
+#if LATENCY_STATS
+
+                case VENDOR_REQ_GET_LATENCY_HIST:
+                usb_vendor_req_get_latency_hist(&usb_req);
+                return;
+#endif
+#if USB_TRACE
+
+                case VENDOR_REQ_GET_TRACE:
+                usb_vendor_req_get_trace(&usb_req);
+                return;
+#endif
+            }
+            break;
         }
-        printf("%d: unhandled request\n", __LINE__);
-        printf("request_type: 0x%02x, request: 0x%02x, value: 0x%04x, index: 0x%04x, len: 0x%04x\n",
-               usb_req.request_type, usb_req.request, usb_req.value,
-               usb_req.index, usb_req.length);
+        DEBUG_LOG("unhandled request: 0x%04x, value: 0x%04x, index: 0x%04x, len: 0x%04x\n",
+                  usb_req.request_type<<8 | usb_req.request, usb_req.value,
+                  usb_req.index, usb_req.length);
         PORT(LED2_BASE) &= ~(1<<LED2_PIN);
+        trace_dump();
         halt();
     }
 }
 
-int8_t usb_joypad_send(void)
+/*
+ * Hands the published report of a port to its endpoint. If both banks still
+ * hold reports the host hasn't read, e.g. because nothing has opened the
+ * interface, the report is left pending and the endpoint interrupt is armed
+ * for when the host takes one. Until then the CPU sleeps, and the next poll
+ * may replace the report with a newer one. Waiting here would hold up the
+ * other ports and keep the CPU awake.
+ */
+int8_t usb_joypad_send(uint8_t port)
 {
-    uint8_t status, timeout;
+    uint8_t status;
+    struct joypad *joypad = &joypads[port];
+    const struct joypad_report_buf *buf = joypad_report_published(joypad);
 
     if (!usb_configuration) return -1;
+    /* Nothing new since the last send */
+    if (buf->seq == joypad->sent_seq) return 0;
+#if REPORT_ON_CHANGE
+    if (!joypad_report_changed(joypad, &buf->report) &&
+        (uint8_t)(UDFNUML - joypad->last_frame) < REPORT_KEEPALIVE_MS) {
+        joypad->sent_seq = buf->seq;
+        ++report_stats.suppressed;
+        return 0;
+    }
+#endif
     status = SREG;
     cli();
-    UENUM = GAMEPAD_EP;
-    timeout = UDFNUML + 50;
-    while (1) {
-        /* Wait for ready */
-        if (UEINTX & (1<<RWAL))
-            break;
+    UENUM = GAMEPAD_EP(port);
+    if (!(UEINTX & (1<<RWAL))) {
+        UEIENX = 1<<TXINE;
         SREG = status;
-        if (!usb_configuration)
-            return -1;
-        if (UDFNUML == timeout)
-            return -1;
-        status = SREG;
-        cli();
-        UENUM = GAMEPAD_EP;
+        /* Only once while the banks stay full, not on every poll */
+        if (!joypad->banks_full) {
+            joypad->banks_full = 1;
+            trace_add(TRACE_SEND_FAIL, port, 0);
+        }
+        return -1;
     }
-    usb_fifo_write_raw((void *)&joypad_report, sizeof(joypad_report));
+    usb_fifo_write_raw((void *)&buf->report, sizeof(buf->report));
     UEINTX = (1<<RWAL) | (1<<NAKOUTI) | (1<<RXSTPI) | (1<<STALLEDI);
     SREG = status;
+    sched_stamp(SCHED_STAGE_SEND);
+    joypad->sent_seq = buf->seq;
+    joypad->banks_full = 0;
+#if REPORT_ON_CHANGE
+    joypad->last_sent = buf->report;
+    joypad->last_frame = UDFNUML;
+#endif
+    ++report_stats.sent;
     return 0;
 }
 
 
+/* Sends the pending reports of the ports whose endpoint has room again */
+static void usb_joypad_send_freed(void)
+{
+    uint8_t freed, port;
+
+    cli();
+    freed = joypad_bank_freed;
+    joypad_bank_freed = 0;
+    sei();
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (freed & (1<<port))
+            usb_joypad_send(port);
+    }
+}
+
+#define CPU_PRESCALE(n) (CLKPR = 0x80, CLKPR = (n))
+
+/*
+ * Wait before probing a port again after a lost response, doubled after each
+ * probe nothing answers up to PROBE_BACKOFF_MAX_MS
+ */
+#define PROBE_BACKOFF_MIN_MS 1
+#ifndef PROBE_BACKOFF_MAX_MS
+#define PROBE_BACKOFF_MAX_MS 8
+#endif
+
+#if PROBE_BACKOFF_MAX_MS < PROBE_BACKOFF_MIN_MS || PROBE_BACKOFF_MAX_MS > 128
+#error "PROBE_BACKOFF_MAX_MS must be between 1 and 128"
+#endif
+
+/* How many times a corrupted response is polled again */
+#ifndef POLL_RETRIES
+#define POLL_RETRIES 2
+#endif
+/* Time a retry takes: the command, the response and some margin */
+#define POLL_RETRY_US 400
+/* Time a probe takes, whether something answers or not */
+#define PROBE_US 150
+/* Time the origin command takes with its 10 byte response */
+#define ORIGIN_US 400
+/* Time a raw samples poll takes with the decode, the ports go one by one */
+#define RAW_POLL_US 435
+
+#if CONTROLLER_RAW_SAMPLES && \
+    CONTROLLER_PORTS * RAW_POLL_US > SCHED_LEAD_MAX_US
+#error "The raw samples polls of the ports don't fit in SCHED_LEAD_MAX_US"
+#endif
+
+#if CONTROLLER_SLICED
+static const uint8_t controller_data_bits[] = {
+    CONTROLLER_DATA_BIT0,
+    CONTROLLER_DATA_BIT1,
+    CONTROLLER_DATA_BIT2,
+    CONTROLLER_DATA_BIT3,
+};
+
+static uint8_t slices[CONTROLLER_SLICES];
+/* The lines whose response started too late or drifted off the phase */
+static uint8_t slices_late;
+/* The lines the phase of the next poll follows, and the port followed last */
+static uint8_t slices_follow = CONTROLLER_DATA_MASK;
+static uint8_t slices_port;
+#elif CONTROLLER_RAW_SAMPLES
+static uint8_t controller_buffer[CONTROLLER_POLL_BYTES * 4];
+#endif
+
+#if CONTROLLER_SLICED || CONTROLLER_RAW_SAMPLES
+/* A missing controller leaves the line high, which reads as all ones */
+static inline uint8_t joypad_response_absent(const uint8_t *resp)
+{
+    return resp[0] == 0xff && resp[1] == 0xff;
+}
+#endif
+
+/*
+ * Receives the response of a port with the receiver of the build and checks
+ * it. Returns one of enum controller_status. With all the ports polled at
+ * once, only the first try comes from the slices and the retries poll the
+ * port alone.
+ */
+static uint8_t joypad_poll(uint8_t port, uint8_t *resp, uint8_t retry)
+{
+    uint8_t status;
+
+#if CONTROLLER_SLICED
+    if (!retry) {
+        uint8_t bit = controller_data_bits[port];
+
+        controller_unslice(slices, bit, resp, CONTROLLER_POLL_BYTES);
+        if (joypad_response_absent(resp))
+            status = CONTROLLER_TIMEOUT;
+        else if (slices_late & (1<<bit))
+            status = CONTROLLER_BAD_BITS;
+        else if (!(slices[CONTROLLER_POLL_BITS] & (1<<bit)))
+            status = CONTROLLER_BAD_STOP;
+        else
+            status = CONTROLLER_OK;
+    } else {
+        status = controller_poll(port, resp, CONTROLLER_POLL_BYTES);
+    }
+#elif CONTROLLER_RAW_SAMPLES
+    controller_poll_raw(port, controller_buffer, sizeof(controller_buffer));
+    controller_decode_state(controller_buffer, resp, CONTROLLER_POLL_BYTES);
+    /* The oversampled response ends before the stop bit */
+    status = joypad_response_absent(resp) ? CONTROLLER_TIMEOUT : CONTROLLER_OK;
+#elif CONTROLLER_SPI
+    status = controller_spi_poll(resp, CONTROLLER_POLL_BYTES);
+#elif CONTROLLER_ICP
+    status = controller_icp_poll(resp, CONTROLLER_POLL_BYTES);
+#else
+    /* Decoded while receiving */
+    status = controller_poll(port, resp, CONTROLLER_POLL_BYTES);
+#endif
+
+    if (status == CONTROLLER_OK && joypad_response_check(resp))
+        status = CONTROLLER_BAD_BITS;
+    ++poll_stats.polls[status];
+
+    return status;
+}
+
+/* Makes the port probed again from the next slot on */
+static void joypad_disconnect(struct joypad *joypad)
+{
+    joypad->state = JOYPAD_ABSENT;
+    joypad->probe_backoff = PROBE_BACKOFF_MIN_MS;
+    joypad->probe_wait = 1;
+}
+
+#if CONTROLLER_SLICED
 /*
- * A bit in the controller state is encoded into four bits. This decodess two
- * original bits from a byte received from the controller.
+ * Picks the lines the phase of the next sliced poll follows. The phase
+ * follows the first line to start a bit, and a controller answering later or
+ * whose clock drifts from the others is reported rather than received wrong.
+ * A retry doesn't fit in after the sliced poll, so such a port is followed
+ * alone from the next poll on. While that leaves other ports off the phase,
+ * the ports reported are followed in turn, so a port reported is received
+ * right again within CONTROLLER_PORTS slots. Following a port that stopped
+ * answering would leave the others nothing to follow, so all the lines are
+ * followed again once it's disconnected.
  */
+static void joypad_slices_follow(void)
+{
+    uint8_t port, line, late = 0;
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        line = 1<<controller_data_bits[port];
+        if (joypads[port].state != JOYPAD_CONNECTED) {
+            if (slices_follow == line)
+                slices_follow = CONTROLLER_DATA_MASK;
+        } else if (slices_late & line) {
+            late |= 1<<port;
+        }
+    }
+    if (!late)
+        return;
 
-#define ENC_BIT_THRESHOLD 2 /* This seems to work the best */
+    do {
+        slices_port = (slices_port + 1) % CONTROLLER_PORTS;
+    } while (!(late & (1<<slices_port)));
+    slices_follow = 1<<controller_data_bits[slices_port];
+}
+#endif
 
-static uint8_t controller_decode_byte(uint8_t v)
+/*
+ * Publishes and sends the decoded response of a port. A missing response
+ * disconnects the port, a corrupted one keeps the last good report.
+ */
+static void joypad_update(uint8_t port, const uint8_t *resp, uint8_t status)
 {
-    uint8_t b0, b1;
+    struct joypad *joypad = &joypads[port];
+    struct joypad_report report, *staging;
 
     /*
-     * In the correct case the middle bits should be the most important in
-     * determining the value of the encoded bit.
+     * The third bit asks for the origin to be read again, which happens on
+     * the probe right after the disconnect
      */
-    b0 = (v & 1);
-    b0 += ((v>>1) & 1) * 2;
-    b0 += ((v>>2) & 1) * 2;
-    b0 += (v>>3) & 1;
+    if (status == CONTROLLER_TIMEOUT ||
+        (status == CONTROLLER_OK && (resp[0] & 0x20))) {
+        joypad_disconnect(joypad);
+        return;
+    }
+    if (status != CONTROLLER_OK)
+        return;
 
-    b1 = ((v>>4) & 1);
-    b1 += ((v>>5) & 1) * 2;
-    b1 += ((v>>6) & 1) * 2;
-    b1 += (v>>7) & 1;
+    joypad_response_unpack(&report, resp, controller_mode);
+    staging = joypad_report_staging(joypad);
+    joypad_report_transform(staging, &report, &joypad->origin, calib_luts);
+    sched_stamp(SCHED_STAGE_DECODE);
+    joypad_report_publish(joypad);
 
-    return (b0 > ENC_BIT_THRESHOLD) | ((b1 > ENC_BIT_THRESHOLD)<<1);
+    usb_joypad_send(port);
 }
 
-static inline void controller_decode_state(uint8_t *buf,
-                                           volatile struct joypad_report *report)
+/*
+ * Probes the ports in the mask. The controllers that answer get their origin
+ * read in their next poll slot, see joypad_read_origin(). A port without a
+ * controller is probed again after the backoff, which then doubles. A
+ * controller also asks for its origin to be read by setting the third bit of
+ * its response, which joypad_update() takes as a disconnect.
+ *
+ * The probe keeps the interrupts disabled, so it's only sent when it ends
+ * before the next SOF and the next poll, see sched_idle_fits(). Returns the
+ * ports left for a later call.
+ */
+static uint8_t joypad_probe(uint8_t ports)
 {
-    unsigned char byte;
+    struct joypad *joypad;
+    uint8_t port;
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (!(ports & (1<<port)))
+            continue;
+        joypad = &joypads[port];
 
-    for (uint16_t i = 0; i < sizeof(*report); ++i) {
-        byte = 0;
-        byte |= (controller_decode_byte(buf[i * 4]))<<6;
-        byte |= (controller_decode_byte(buf[i * 4 + 1]))<<4;
-        byte |= (controller_decode_byte(buf[i * 4 + 2]))<<2;
-        byte |= (controller_decode_byte(buf[i * 4 + 3]))<<0;
-        ((char *)report)[i] = byte;
+        if (!sched_idle_fits(PROBE_US))
+            break;
+        if (controller_probe(port, joypad->id) == CONTROLLER_OK) {
+            joypad->device = controller_device(joypad->id);
+        } else {
+            memset(joypad->id, 0, sizeof(joypad->id));
+            joypad->device = JOYBUS_DEVICE_NONE;
+        }
+        ports &= ~(1<<port);
+
+        /* The keyboard has its own poll command and report, not supported */
+        if (joypad->device != JOYBUS_DEVICE_STANDARD &&
+            joypad->device != JOYBUS_DEVICE_WAVEBIRD) {
+            joypad->probe_wait = sched_slots(joypad->probe_backoff);
+            if (joypad->probe_backoff < PROBE_BACKOFF_MAX_MS)
+                joypad->probe_backoff <<= 1;
+            continue;
+        }
+        joypad->state = JOYPAD_ORIGIN;
     }
+
+    return ports;
 }
 
-#define CPU_PRESCALE(n) (CLKPR = 0x80, CLKPR = (n))
+/*
+ * Reads the origin of a port that answered the probe in the place of its
+ * poll, and polls it from the next slot on. The origin read takes about as
+ * long as a poll, but a port that wasn't polled isn't in the lead yet, so the
+ * read waits for a slot that has the time. Returns 1 if it was read.
+ */
+static uint8_t joypad_read_origin(uint8_t port)
+{
+    struct joypad *joypad = &joypads[port];
+    struct joypad_report origin;
+
+    if (!sched_poll_fits(ORIGIN_US)) {
+        sched_poll_want(ORIGIN_US);
+        return 0;
+    }
+    /* The first two bits of the response are always zero */
+    if (controller_origin(port, &origin, sizeof(origin)) == CONTROLLER_OK &&
+        !(origin.buttons_0 & 0xc0))
+        joypad->origin = origin;
+    joypad->state = JOYPAD_CONNECTED;
+
+    return 1;
+}
+
+#if REMOTE_WAKEUP
+/* How long the host gets to answer the resume signal */
+#define REMOTE_WAKEUP_WAIT_MS 20
+
+/*
+ * Sends the resume signal, which needs the clock but SUSPI still set, and
+ * waits for the host to resume the bus. Power down would stop the clock under
+ * the signal, so this spins. If the host doesn't answer, the clock is frozen
+ * again and the caller goes back to sleep.
+ */
+static void usb_wakeup_host(void)
+{
+    uint16_t start;
+
+    cli();
+    usb_pll_start();
+    USBCON &= ~(1<<FRZCLK);
+    UDCON |= 1<<RMWKUP;
+    ++power_stats.remote_wakeups;
+    sei();
+
+    /* Cleared by the hardware once the signal has been sent */
+    while (UDCON & (1<<RMWKUP))
+        ;
+    start = TCNT3;
+    while (usb_suspended && (uint16_t)(TCNT3 - start) <
+                            REMOTE_WAKEUP_WAIT_MS * 1000U * SCHED_TICKS_PER_US)
+        ;
+
+    cli();
+    if (usb_suspended) {
+        USBCON |= 1<<FRZCLK;
+        PLLCSR &= ~(1<<PLLE);
+    }
+    sei();
+}
+#endif
+
+/* Any button, the high bit of the second byte is always set */
+static inline uint8_t joypad_response_pressed(const uint8_t *resp)
+{
+    return (resp[0] & 0x1f) || (resp[1] & 0x7f);
+}
+
+/* Polls the connected ports, returns the ones with a button pressed */
+static uint8_t joypad_poll_pressed(void)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES];
+    uint8_t port, pressed = 0;
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (joypads[port].state != JOYPAD_CONNECTED)
+            continue;
+        if (controller_poll(port, resp, sizeof(resp)) == CONTROLLER_OK &&
+            !joypad_response_check(resp) && joypad_response_pressed(resp))
+            pressed |= 1<<port;
+    }
+
+    return pressed;
+}
+
+/*
+ * Runs while the bus is suspended. The controllers are polled with the
+ * rumble off so that no motor is left running, and the CPU then sleeps in
+ * power down until the bus wakes up. With the remote wakeup allowed, the
+ * watchdog wakes the CPU to poll again, and a button that wasn't pressed on
+ * the previous poll wakes the host.
+ */
+static void joypad_suspend(void)
+{
+#if REMOTE_WAKEUP
+    uint8_t pressed, held = 0xff;
+#endif
+
+    controller_rumble = 0;
+    controller_rumble_lines = 0;
+    while (usb_suspended) {
+#if REMOTE_WAKEUP
+        pressed = joypad_poll_pressed();
+        if (usb_remote_wakeup && (pressed & ~held)) {
+            usb_wakeup_host();
+            return;
+        }
+        held = pressed;
+#else
+        joypad_poll_pressed();
+#endif
+
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        cli();
+        if (usb_suspended) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+    }
+}
+
+/*
+ * Polls the connected ports in the slot sched_wait() started and sends their
+ * reports. The ports that aren't connected are added to the probe mask when
+ * their wait is up, which is returned.
+ */
+static uint8_t joypad_poll_slot(uint8_t probe)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES];
+    uint8_t port, status, retry;
+
+    controller_mode = controller_mode_new;
+    controller_rumble = joypad_rumble;
+#if CONTROLLER_SLICED
+    controller_rumble_lines = 0;
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (controller_rumble & (1<<port))
+            controller_rumble_lines |= 1<<controller_data_bits[port];
+    }
+#endif
+
+#if CONTROLLER_SLICED
+    /*
+     * All the ports are polled at the cost of one, and an origin read takes
+     * the place of that poll, one port per slot
+     */
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (joypads[port].state != JOYPAD_ORIGIN)
+            continue;
+        if (joypad_read_origin(port)) {
+            sched_poll_done();
+            return probe;
+        }
+        break;
+    }
+    slices_late = controller_poll_sliced(slices, slices_follow);
+    sched_stamp(SCHED_STAGE_RECV);
+#endif
+
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        if (joypads[port].state == JOYPAD_ABSENT) {
+            if (!(probe & (1<<port)) && --joypads[port].probe_wait == 0)
+                probe |= 1<<port;
+            continue;
+        }
+        if (joypads[port].state == JOYPAD_ORIGIN) {
+#if !CONTROLLER_SLICED
+            joypad_read_origin(port);
+#endif
+            continue;
+        }
+
+        status = joypad_poll(port, resp, 0);
+        /*
+         * A lost response is not worth a retry, a corrupted one is. A retry
+         * is budgeted in the lead whether it ran or didn't fit, so that the
+         * following polls start early enough for one.
+         */
+        sched_poll_pause();
+        for (retry = 0; status != CONTROLLER_OK &&
+                        status != CONTROLLER_TIMEOUT &&
+                        retry < POLL_RETRIES &&
+                        sched_poll_fits(POLL_RETRY_US); ++retry) {
+            ++poll_stats.retries;
+            status = joypad_poll(port, resp, 1);
+        }
+        sched_poll_resume();
+        if (retry || (status != CONTROLLER_OK && status != CONTROLLER_TIMEOUT))
+            sched_poll_want(POLL_RETRY_US);
+#if !CONTROLLER_SLICED
+        sched_stamp(SCHED_STAGE_RECV);
+#endif
+        joypad_update(port, resp, status);
+    }
+#if CONTROLLER_SLICED
+    joypad_slices_follow();
+#endif
+
+    sched_poll_done();
+
+    return probe;
+}
 
 int main(void)
 {
-    static uint8_t controller_buffer[(sizeof(struct joypad_report)) * 4] = {0};
+    uint8_t port;
+    /* The ports waiting for a probe or an origin read */
+    uint8_t probe = 0;
 
     CPU_PRESCALE(0);
 
     led_init();
     usart_init();
     stdio_init();
+    sched_init();
+    calib_init();
+#if CONTROLLER_ICP
+    controller_icp_init();
+#endif
+#if CONTROLLER_SPI
+    controller_spi_init();
+#endif
     usb_init();
 
-    /* Make sure the pin is down because external pull up resistors are used */
+    /* Make sure the pins are down because external pull up resistors are used */
     /* The pin state is changed by pulling it down with DDR reg */
-    CONTROLLER_DATA_PORT &= ~(1<<CONTROLLER_DATA_BIT);
+    CONTROLLER_DATA_PORT &= ~CONTROLLER_DATA_MASK;
 
-    controller_probe();
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        joypads[port].origin = joypad_origin_default;
+        /* Probed in the first slot */
+        joypads[port].probe_backoff = PROBE_BACKOFF_MIN_MS;
+        joypads[port].probe_wait = 1;
+    }
 
     for (;;) {
-        _delay_ms(8);
-
-        controller_poll(&controller_buffer, sizeof(controller_buffer));
-
-        if (controller_buffer[0] != 0x11) {
-            _delay_ms(12);
-            controller_probe();
+        if (usb_suspended) {
+            joypad_suspend();
+            continue;
+        }
+        /* Sleep until the poll slot right before the host reads the report */
+        if (!sched_wait()) {
+            usb_joypad_send_freed();
+            /* Usually right after the SOF, where the most time is left */
+            if (probe)
+                probe = joypad_probe(probe);
             continue;
         }
+        probe = joypad_poll_slot(probe);
 
-        /*
-         * The decoded packet from the controller is used as the HID report.
-         * The HID report descriptor specifies the field order and padding
-         * identitcal to the decoded controller packet. Only minor modifications
-         * like offsetting and axis flipping are required to pass the decoded
-         * packet as a HID report.
-         */
-        controller_decode_state(controller_buffer, &joypad_report);
-
-        joypad_report.buttons_0 = joypad_report.buttons_0;
-        joypad_report.buttons_1 = joypad_report.buttons_1;
-        joypad_report.joy_x += 127;
-        joypad_report.joy_y = 127 - joypad_report.joy_y;
-        joypad_report.c_x += 127;
-        joypad_report.c_y = 127 - joypad_report.c_y;
-        joypad_report.l = joypad_report.l;
-        joypad_report.r = joypad_report.r;
-
-        usb_joypad_send();
+        /* The slow parts are left out of the measured poll time */
+        calib_update();
+        debug_poll();
     }
 }
@@ -0,0 +1,23 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+
+/*
+ * The state of the controller at full resolution, whatever the analog mode.
+ * The HID report uses the same layout, only the axes are offset and flipped.
+ */
+struct joypad_report {
+    uint8_t buttons_0;
+    uint8_t buttons_1;
+    uint8_t joy_x;
+    uint8_t joy_y;
+    uint8_t c_x;
+    uint8_t c_y;
+    uint8_t l;
+    uint8_t r;
+    uint8_t a;
+    uint8_t b;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,270 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <string.h>
+
+#include "sched.h"
+
+#if (REPORT_INTERVAL_MS & (REPORT_INTERVAL_MS - 1)) || \
+    REPORT_INTERVAL_MS < 1 || REPORT_INTERVAL_MS > SCHED_INTERVAL_MAX
+#error "REPORT_INTERVAL_MS must be 1, 2, 4 or 8"
+#endif
+
+static volatile uint8_t sched_interval = REPORT_INTERVAL_MS;
+static volatile uint8_t sched_pending;
+static uint16_t sched_poll_start;
+/* Time of the last SOF, and the SOF the report of the current poll is due */
+static volatile uint16_t sched_sof_time;
+static uint16_t sched_poll_deadline;
+/* Time of the current poll left out of the lead, and when the pause began */
+static uint16_t sched_poll_excluded;
+static uint16_t sched_poll_paused;
+/* Time budgeted in the lead for work the current poll needed */
+static uint16_t sched_poll_wanted;
+/* Measured time from the poll start to the report being in the bank */
+static volatile uint16_t sched_lead = SCHED_LEAD_INITIAL_US * SCHED_TICKS_PER_US;
+
+#if LATENCY_STATS
+static uint16_t sched_hists[SCHED_STAGES][SCHED_HIST_BUCKETS];
+static volatile uint16_t sched_send_time;
+static volatile uint8_t sched_send_stamped;
+
+/* Counts a latency into its bucket, the counters saturate */
+static void sched_hist_add(uint8_t stage, uint16_t t)
+{
+    uint16_t bucket = t / SCHED_HIST_BUCKET_TICKS;
+    uint16_t *count;
+
+    if (bucket >= SCHED_HIST_BUCKETS)
+        bucket = SCHED_HIST_BUCKETS - 1;
+    count = &sched_hists[stage][bucket];
+    if (*count != 0xffff)
+        ++*count;
+}
+
+/*
+ * Records that a stage of the current poll has been reached. The histograms
+ * are read and cleared from the USB interrupt, so the counter can't be
+ * updated halfway when it comes.
+ */
+void sched_stamp(uint8_t stage)
+{
+    uint16_t now = TCNT3;
+    uint8_t status;
+
+    status = SREG;
+    cli();
+    sched_hist_add(stage, now - sched_poll_start);
+    if (stage == SCHED_STAGE_SEND) {
+        sched_send_time = now;
+        sched_send_stamped = 1;
+    }
+    SREG = status;
+}
+
+const uint16_t *sched_hist(uint8_t stage)
+{
+    return sched_hists[stage];
+}
+
+void sched_hist_reset(void)
+{
+    uint8_t status;
+
+    status = SREG;
+    cli();
+    memset(sched_hists, 0, sizeof(sched_hists));
+    SREG = status;
+}
+#endif
+
+void sched_init(void)
+{
+    TCCR3A = 0;
+    TCCR3B = 1<<CS31; /* Normal mode, clk/8 */
+    TIMSK3 = 0;
+}
+
+/*
+ * Changes the poll interval at runtime. The host keeps polling the endpoint
+ * at the interval in the endpoint descriptor, so going below
+ * REPORT_INTERVAL_MS only makes the reports fresher, not more frequent.
+ */
+int8_t sched_set_interval(uint16_t ms)
+{
+    if (ms < 1 || ms > SCHED_INTERVAL_MAX || (ms & (ms - 1)))
+        return -1;
+    sched_interval = ms;
+    return 0;
+}
+
+uint8_t sched_get_interval(void)
+{
+    return sched_interval;
+}
+
+/* Number of poll slots that covers at least ms milliseconds */
+uint8_t sched_slots(uint8_t ms)
+{
+    uint8_t interval = sched_interval;
+
+    return (ms + interval - 1) / interval;
+}
+
+/*
+ * Called from the USB device interrupt on every start of frame. In the frame
+ * before the host reads the endpoint, the compare match is armed so that the
+ * poll finishes just before the next SOF.
+ */
+void sched_sof(void)
+{
+    uint16_t now = TCNT3;
+    uint16_t delay;
+
+    sched_sof_time = now;
+#if LATENCY_STATS
+    if (sched_send_stamped) {
+        sched_send_stamped = 0;
+        sched_hist_add(SCHED_STAGE_SOF, now - sched_send_time);
+    }
+#endif
+
+    if ((UDFNUML + 1) & (sched_interval - 1))
+        return;
+
+    delay = SCHED_FRAME_TICKS - sched_lead -
+            SCHED_LEAD_MARGIN_US * SCHED_TICKS_PER_US;
+    OCR3A = now + delay;
+    TIFR3 = 1<<OCF3A;
+    /*
+     * A compare value the timer has already passed would only match after
+     * the timer wraps, start the poll right away instead
+     */
+    if ((uint16_t)(TCNT3 - now) >= delay) {
+        sched_pending = 1;
+        return;
+    }
+    TIMSK3 |= 1<<OCIE3A;
+}
+
+ISR(TIMER3_COMPA_vect)
+{
+    TIMSK3 &= ~(1<<OCIE3A);
+    sched_pending = 1;
+}
+
+/*
+ * Sleeps in the idle mode until the next interrupt. Returns 1 if it's time to
+ * start the next poll, 0 if some other interrupt woke the CPU and the caller
+ * should check for its own events first.
+ */
+uint8_t sched_wait(void)
+{
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    /* sei only takes effect after sleep, so the interrupt can't slip between */
+    if (!sched_pending) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+
+    if (!sched_pending)
+        return 0;
+    cli();
+    sched_pending = 0;
+    sched_poll_start = TCNT3;
+    /* Scheduled in the frame before the one the host reads the report in */
+    sched_poll_deadline = sched_sof_time + SCHED_FRAME_TICKS;
+    sei();
+    sched_poll_excluded = 0;
+    sched_poll_wanted = 0;
+    return 1;
+}
+
+/*
+ * Whether something taking us microseconds still fits before the report of
+ * the current poll is due, i.e. ends SCHED_LEAD_MARGIN_US before the next
+ * SOF, which leaves the time to send the report. The poll may have started
+ * late, so this is counted from the SOF and not from the poll start.
+ */
+uint8_t sched_poll_fits(uint16_t us)
+{
+    int16_t left = sched_poll_deadline - TCNT3;
+
+    return left >= (int16_t)((us + SCHED_LEAD_MARGIN_US) * SCHED_TICKS_PER_US);
+}
+
+/*
+ * Whether something taking us microseconds with the interrupts disabled fits
+ * in before the next SOF and the next poll, so that it holds up neither. For
+ * the work done between the polls, which fits right after the SOF.
+ */
+uint8_t sched_idle_fits(uint16_t us)
+{
+    int16_t need = (us + SCHED_LEAD_MARGIN_US) * SCHED_TICKS_PER_US;
+    uint16_t now;
+    uint8_t status, fits;
+
+    status = SREG;
+    cli();
+    now = TCNT3;
+    fits = !sched_pending &&
+           (int16_t)(sched_sof_time + SCHED_FRAME_TICKS - now) >= need;
+    if (TIMSK3 & (1<<OCIE3A))
+        fits = fits && (int16_t)(OCR3A - now) >= need;
+    SREG = status;
+
+    return fits;
+}
+
+/*
+ * Leaves the time between these two out of the lead, for work that is
+ * budgeted with sched_poll_want() instead, like the retries.
+ */
+void sched_poll_pause(void)
+{
+    sched_poll_paused = TCNT3;
+}
+
+void sched_poll_resume(void)
+{
+    sched_poll_excluded += TCNT3 - sched_poll_paused;
+}
+
+/*
+ * Budgets us microseconds in the lead for work the current poll needed, like
+ * a retry, whether it ran or didn't fit. The next polls then start early
+ * enough for it until the lead decays back, so that a controller that keeps
+ * glitching gets its retries. Work that would take the lead past
+ * SCHED_LEAD_MAX_US isn't budgeted, it wouldn't fit anyway.
+ */
+void sched_poll_want(uint16_t us)
+{
+    sched_poll_wanted += us * SCHED_TICKS_PER_US;
+}
+
+/*
+ * Called once the report has been handed to the endpoint. Increases in the
+ * poll time are followed immediately, decreases slowly so that a single fast
+ * poll doesn't make the next one late.
+ */
+void sched_poll_done(void)
+{
+    uint16_t t = TCNT3 - sched_poll_start - sched_poll_excluded;
+    uint16_t lead = sched_lead;
+
+    if (t + sched_poll_wanted <= SCHED_LEAD_MAX_US * SCHED_TICKS_PER_US)
+        t += sched_poll_wanted;
+    if (t > lead)
+        lead = t;
+    else
+        lead -= (lead - t) >> 3;
+
+    if (lead > SCHED_LEAD_MAX_US * SCHED_TICKS_PER_US)
+        lead = SCHED_LEAD_MAX_US * SCHED_TICKS_PER_US;
+
+    sched_lead = lead;
+}
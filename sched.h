@@ -0,0 +1,80 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+/* Timer3 runs at F_CPU / 8 */
+#define SCHED_TICKS_PER_US (F_CPU / 8000000UL)
+#define SCHED_FRAME_TICKS (1000 * SCHED_TICKS_PER_US)
+
+/*
+ * Default report interval in milliseconds, i.e. USB frames. This is also the
+ * interval in the endpoint descriptor. Must be 1, 2, 4 or 8.
+ */
+#ifndef REPORT_INTERVAL_MS
+#define REPORT_INTERVAL_MS 1
+#endif
+
+#define SCHED_INTERVAL_MAX 8
+
+/* Extra time left between the end of the poll and the next SOF */
+#ifndef SCHED_LEAD_MARGIN_US
+#define SCHED_LEAD_MARGIN_US 50
+#endif
+
+/* Initial guess for the poll + decode + send time before it's measured */
+#define SCHED_LEAD_INITIAL_US 450
+/*
+ * The lead is never taken longer than this, so that the poll is always
+ * scheduled after the SOF it's scheduled from. A single port's poll and a
+ * retry fit in it.
+ */
+#define SCHED_LEAD_MAX_US 900
+
+#if SCHED_LEAD_MAX_US + SCHED_LEAD_MARGIN_US > 950
+#error "SCHED_LEAD_MARGIN_US is too long"
+#endif
+
+/* Set to 0 to leave out the latency histograms */
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 1
+#endif
+
+/*
+ * Latency stages. The first three are measured from the poll start, the
+ * last from the bank handoff to the next SOF, i.e. how much time was left.
+ */
+enum sched_stage {
+    SCHED_STAGE_RECV,       /* Response received */
+    SCHED_STAGE_DECODE,     /* Response decoded into the report */
+    SCHED_STAGE_SEND,       /* Report handed to the endpoint bank */
+    SCHED_STAGE_SOF,        /* SOF after the handoff */
+    SCHED_STAGES
+};
+
+#define SCHED_HIST_BUCKETS 8
+#define SCHED_HIST_BUCKET_US 128
+#define SCHED_HIST_BUCKET_TICKS (SCHED_HIST_BUCKET_US * SCHED_TICKS_PER_US)
+
+void sched_init(void);
+int8_t sched_set_interval(uint16_t ms);
+uint8_t sched_get_interval(void);
+uint8_t sched_slots(uint8_t ms);
+void sched_sof(void);
+uint8_t sched_wait(void);
+uint8_t sched_poll_fits(uint16_t us);
+uint8_t sched_idle_fits(uint16_t us);
+void sched_poll_pause(void);
+void sched_poll_resume(void);
+void sched_poll_want(uint16_t us);
+void sched_poll_done(void);
+
+#if LATENCY_STATS
+void sched_stamp(uint8_t stage);
+const uint16_t *sched_hist(uint8_t stage);
+void sched_hist_reset(void);
+#else
+static inline void sched_stamp(uint8_t stage) {}
+#endif
+
+#endif
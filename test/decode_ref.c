@@ -0,0 +1,36 @@
+#include "controller.h"
+#include "decode_ref.h"
+
+uint8_t decode_ref_byte(uint8_t v)
+{
+    uint8_t b0, b1;
+
+    /*
+     * In the correct case the middle bits should be the most important in
+     * determining the value of the encoded bit.
+     */
+    b0 = (v & 1);
+    b0 += ((v>>1) & 1) * 2;
+    b0 += ((v>>2) & 1) * 2;
+    b0 += (v>>3) & 1;
+
+    b1 = ((v>>4) & 1);
+    b1 += ((v>>5) & 1) * 2;
+    b1 += ((v>>6) & 1) * 2;
+    b1 += (v>>7) & 1;
+
+    return (b0 > ENC_BIT_THRESHOLD) | ((b1 > ENC_BIT_THRESHOLD)<<1);
+}
+
+void decode_ref_state(const uint8_t *buf, uint8_t *report, uint8_t len)
+{
+    uint8_t byte;
+
+    while (len--) {
+        byte = decode_ref_byte(*buf++)<<6;
+        byte |= decode_ref_byte(*buf++)<<4;
+        byte |= decode_ref_byte(*buf++)<<2;
+        byte |= decode_ref_byte(*buf++);
+        *report++ = byte;
+    }
+}
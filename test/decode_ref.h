@@ -0,0 +1,14 @@
+#ifndef DECODE_REF_H
+#define DECODE_REF_H
+
+#include <stdint.h>
+
+/*
+ * The arithmetic decoder of the oversampled response that the lookup table
+ * in decode.c replaced, kept as the reference for the table.
+ */
+
+uint8_t decode_ref_byte(uint8_t v);
+void decode_ref_state(const uint8_t *buf, uint8_t *report, uint8_t len);
+
+#endif
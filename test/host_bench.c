@@ -0,0 +1,165 @@
+/*
+ * Throughput of the decode and report path on the host, built with make
+ * host-bench. The input is a set of synthetic responses from samples.c,
+ * prepared up front so that only the decoding is timed. The numbers are for
+ * comparing a change against the one before it on the same machine, the AVR
+ * itself is much slower.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "controller.h"
+#include "decode.h"
+#include "decode_ref.h"
+#include "samples.h"
+
+#define ARRAY_LEN(a) (sizeof(a)/sizeof(a[0]))
+
+/* Number of different inputs, cycled through */
+#define SETS 256
+/* Calls per benchmark */
+#define CALLS 4000000UL
+
+static uint8_t resps[SETS][CONTROLLER_POLL_BYTES];
+static uint8_t raw[SETS][CONTROLLER_POLL_BYTES * 4];
+static uint8_t raw_noisy[SETS][CONTROLLER_POLL_BYTES * 4];
+static uint8_t slices[SETS][CONTROLLER_SLICES];
+static uint8_t edges[SETS][CONTROLLER_POLL_BITS + 1];
+static struct joypad_report reports[SETS];
+static struct joypad_report origin = {
+    .joy_x = 128, .joy_y = 128, .c_x = 128, .c_y = 128,
+};
+static uint8_t luts[STICK_AXES][256];
+
+/* Keeps the results from being optimized away */
+static volatile uint8_t sink;
+
+static void bench_decode_state(unsigned long i)
+{
+    uint8_t out[CONTROLLER_POLL_BYTES];
+
+    controller_decode_state(raw[i % SETS], out, sizeof(out));
+    sink = out[7];
+}
+
+static void bench_decode_state_noisy(unsigned long i)
+{
+    uint8_t out[CONTROLLER_POLL_BYTES];
+
+    controller_decode_state(raw_noisy[i % SETS], out, sizeof(out));
+    sink = out[7];
+}
+
+/* The arithmetic decoder the table replaced */
+static void bench_decode_ref(unsigned long i)
+{
+    uint8_t out[CONTROLLER_POLL_BYTES];
+
+    decode_ref_state(raw[i % SETS], out, sizeof(out));
+    sink = out[7];
+}
+
+static void bench_unslice(unsigned long i)
+{
+    uint8_t out[CONTROLLER_POLL_BYTES];
+
+    controller_unslice(slices[i % SETS], i & 1 ? 6 : 1, out, sizeof(out));
+    sink = out[7];
+}
+
+static void bench_decode_icp(unsigned long i)
+{
+    uint8_t out[CONTROLLER_POLL_BYTES];
+
+    controller_decode_icp(edges[i % SETS], 64, out, sizeof(out));
+    sink = out[7];
+}
+
+static void bench_response_unpack(unsigned long i)
+{
+    struct joypad_report r;
+
+    joypad_response_unpack(&r, resps[i % SETS], i % (ANALOG_MODE_MAX + 1));
+    sink = r.b;
+}
+
+static void bench_report_transform(unsigned long i)
+{
+    struct joypad_report r;
+
+    joypad_report_transform(&r, &reports[i % SETS], &origin, luts);
+    sink = r.c_y;
+}
+
+/* What the main loop does with a sliced response */
+static void bench_poll_path(unsigned long i)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES];
+    struct joypad_report report, r;
+
+    controller_unslice(slices[i % SETS], 1, resp, sizeof(resp));
+    if (joypad_response_check(resp))
+        return;
+    joypad_response_unpack(&report, resp, ANALOG_MODE);
+    joypad_report_transform(&r, &report, &origin, luts);
+    sink = r.c_y;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(unsigned long i);
+} benches[] = {
+    { "decode_state",       bench_decode_state },
+    { "decode_state noisy", bench_decode_state_noisy },
+    { "decode arithmetic",  bench_decode_ref },
+    { "unslice",            bench_unslice },
+    { "decode_icp",         bench_decode_icp },
+    { "response_unpack",    bench_response_unpack },
+    { "report_transform",   bench_report_transform },
+    { "poll path",          bench_poll_path },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    static const uint8_t bits[] = { 0, 1, 6, 7 };
+    const uint8_t *ports[4];
+    unsigned int i, j;
+    unsigned long n;
+    double t;
+
+    for (i = 0; i < SETS; ++i)
+        samples_response(resps[i], CONTROLLER_POLL_BYTES);
+    for (i = 0; i < SETS; ++i) {
+        for (j = 0; j < 4; ++j)
+            ports[j] = resps[(i + j) % SETS];
+        samples_oversample(resps[i], CONTROLLER_POLL_BYTES, raw[i], 0);
+        samples_oversample(resps[i], CONTROLLER_POLL_BYTES, raw_noisy[i], 1);
+        samples_slice(ports, bits, 4, CONTROLLER_POLL_BYTES, slices[i]);
+        samples_edges(resps[i], CONTROLLER_POLL_BYTES, 64,
+                      (int16_t)(samples_rand() % 61) - 30, edges[i]);
+        joypad_response_unpack(&reports[i], resps[i], ANALOG_MODE);
+    }
+    for (i = 0; i < STICK_AXES; ++i)
+        stick_lut_build(luts[i], 8, 100, i & 1);
+
+    printf("%-20s %10s %10s\n", "", "ns/call", "Mcalls/s");
+    for (i = 0; i < ARRAY_LEN(benches); ++i) {
+        t = now();
+        for (n = 0; n < CALLS; ++n)
+            benches[i].run(n);
+        t = now() - t;
+        printf("%-20s %10.1f %10.1f\n", benches[i].name, t * 1e9 / CALLS,
+               CALLS / t * 1e-6);
+    }
+
+    return 0;
+}
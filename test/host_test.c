@@ -0,0 +1,563 @@
+/*
+ * Correctness tests of the decode and report path, the USB descriptor lookup
+ * and the poll slot, built for the host with make host-test. main.c is included so that
+ * its static functions and tables can be reached, against the register mock
+ * in test/mock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define main firmware_main
+#include "../main.c"
+#undef main
+
+#include "decode_ref.h"
+#include "mock.h"
+#include "samples.h"
+
+static unsigned int checks, failures;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int check(int ok, const char *what, const char *file, int line)
+{
+    ++checks;
+    if (!ok) {
+        ++failures;
+        printf("%s:%d: failed: %s\n", file, line, what);
+    }
+    return ok;
+}
+
+/* The table against the arithmetic it was expanded from, for every byte */
+static void test_decode_table(void)
+{
+    uint8_t buf[4] = { 0 }, out;
+    unsigned int v;
+
+    for (v = 0; v < 256; ++v) {
+        buf[0] = v;
+        controller_decode_state(buf, &out, 1);
+        if (!CHECK(out>>6 == decode_ref_byte(v))) {
+            printf("  input 0x%02x\n", v);
+            break;
+        }
+    }
+}
+
+static void test_decode_state(void)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES], out[CONTROLLER_POLL_BYTES];
+    uint8_t buf[CONTROLLER_POLL_BYTES * 4];
+    unsigned int i;
+
+    for (i = 0; i < 1000; ++i) {
+        samples_response(resp, sizeof(resp));
+        samples_oversample(resp, sizeof(resp), buf, i & 1);
+        controller_decode_state(buf, out, sizeof(out));
+        if (!CHECK(!memcmp(resp, out, sizeof(resp))))
+            return;
+        decode_ref_state(buf, out, sizeof(out));
+        if (!CHECK(!memcmp(resp, out, sizeof(resp))))
+            return;
+    }
+}
+
+static void test_unslice(void)
+{
+    static const uint8_t bits[] = {
+        CONTROLLER_DATA_BIT0, CONTROLLER_DATA_BIT1,
+        CONTROLLER_DATA_BIT2, CONTROLLER_DATA_BIT3,
+    };
+    uint8_t resps[4][CONTROLLER_POLL_BYTES], out[CONTROLLER_POLL_BYTES];
+    const uint8_t *ptrs[4] = { resps[0], resps[1], resps[2], resps[3] };
+    uint8_t slices[CONTROLLER_SLICES];
+    unsigned int i, port;
+
+    for (i = 0; i < 1000; ++i) {
+        for (port = 0; port < 4; ++port)
+            samples_response(resps[port], CONTROLLER_POLL_BYTES);
+        samples_slice(ptrs, bits, 4, CONTROLLER_POLL_BYTES, slices);
+        for (port = 0; port < 4; ++port) {
+            controller_unslice(slices, bits[port], out, sizeof(out));
+            if (!CHECK(!memcmp(resps[port], out, sizeof(out))))
+                return;
+        }
+        /* A line without a controller reads as all ones */
+        controller_unslice(slices, 2 + (i & 1), out, sizeof(out));
+        CHECK(out[0] == 0xff && out[7] == 0xff);
+    }
+}
+
+static void test_decode_edges(void)
+{
+    static const int16_t skews[] = { -50, -20, 0, 20, 50 };
+    uint8_t resp[CONTROLLER_POLL_BYTES], out[CONTROLLER_POLL_BYTES];
+    uint8_t edges[CONTROLLER_POLL_BITS + 1];
+    unsigned int i, j;
+    uint8_t n;
+
+    for (j = 0; j < sizeof(skews) / sizeof(skews[0]); ++j) {
+        for (i = 0; i < 200; ++i) {
+            samples_response(resp, sizeof(resp));
+            n = samples_edges(resp, sizeof(resp), 64, skews[j], edges);
+            memset(out, 0, sizeof(out));
+            /* The last bit is the stop bit */
+            CHECK(controller_decode_edges(edges, n, 64, out, sizeof(out)) == 1);
+            if (!CHECK(!memcmp(resp, out, sizeof(resp)))) {
+                printf("  skew %d permille\n", skews[j]);
+                break;
+            }
+        }
+    }
+
+    /* Two zero to one steps in a row can't happen */
+    memset(resp, 0, sizeof(resp));
+    resp[1] = 0x80;
+    n = samples_edges(resp, sizeof(resp), 64, 0, edges);
+    edges[20] -= 32;
+    edges[21] -= 64;
+    CHECK(controller_decode_edges(edges, n, 64, out, sizeof(out)) < 0);
+}
+
+static void test_decode_icp(void)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES], out[CONTROLLER_POLL_BYTES];
+    uint8_t edges[CONTROLLER_POLL_BITS + 1];
+    unsigned int i;
+
+    for (i = 0; i < 200; ++i) {
+        samples_response(resp, sizeof(resp));
+        samples_edges(resp, sizeof(resp), 64, (int16_t)(i % 121) - 60, edges);
+        if (!CHECK(controller_decode_icp(edges, 64, out, sizeof(out)) ==
+                   CONTROLLER_OK && !memcmp(resp, out, sizeof(resp))))
+            break;
+    }
+
+    /* A zero where the stop bit should be */
+    resp[7] |= 1;
+    samples_edges(resp, sizeof(resp), 64, 0, edges);
+    edges[64] = edges[63] + 96;
+    CHECK(controller_decode_icp(edges, 64, out, sizeof(out)) ==
+          CONTROLLER_BAD_STOP);
+
+    /* A bit time 25% off doesn't add up to the length of a response */
+    samples_edges(resp, sizeof(resp), 64, 0, edges);
+    CHECK(controller_decode_icp(edges, 80, out, sizeof(out)) ==
+          CONTROLLER_BAD_LENGTH);
+    CHECK(controller_decode_icp(edges, 48, out, sizeof(out)) ==
+          CONTROLLER_BAD_LENGTH);
+
+    /* Two zero to one steps in a row */
+    edges[20] -= 32;
+    edges[21] -= 64;
+    edges[22] -= 64;
+    CHECK(controller_decode_icp(edges, 64, out, sizeof(out)) ==
+          CONTROLLER_BAD_BITS);
+}
+
+static void test_response_check(void)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES] = { 0x00, 0x80 };
+
+    CHECK(!joypad_response_check(resp));
+    resp[0] = 0x20;
+    CHECK(!joypad_response_check(resp));
+    resp[0] = 0x40;
+    CHECK(joypad_response_check(resp));
+    resp[0] = 0x00;
+    resp[1] = 0x7f;
+    CHECK(joypad_response_check(resp));
+}
+
+static void test_response_unpack(void)
+{
+    static const uint8_t resp[] = {
+        0x1f, 0x80, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc
+    };
+    struct joypad_report r;
+
+    joypad_response_unpack(&r, resp, 0);
+    CHECK(r.buttons_0 == 0x1f && r.buttons_1 == 0x80);
+    CHECK(r.joy_x == 0x12 && r.joy_y == 0x34);
+    CHECK(r.c_x == 0x56 && r.c_y == 0x78);
+    CHECK(r.l == 0x90 && r.r == 0xa0 && r.a == 0xb0 && r.b == 0xc0);
+
+    joypad_response_unpack(&r, resp, 1);
+    CHECK(r.joy_x == 0x12 && r.joy_y == 0x34);
+    CHECK(r.c_x == 0x50 && r.c_y == 0x60);
+    CHECK(r.l == 0x78 && r.r == 0x9a && r.a == 0xb0 && r.b == 0xc0);
+
+    joypad_response_unpack(&r, resp, 2);
+    CHECK(r.c_x == 0x50 && r.c_y == 0x60);
+    CHECK(r.l == 0x70 && r.r == 0x80 && r.a == 0x9a && r.b == 0xbc);
+
+    joypad_response_unpack(&r, resp, 3);
+    CHECK(r.c_x == 0x56 && r.c_y == 0x78);
+    CHECK(r.l == 0x9a && r.r == 0xbc && r.a == 0 && r.b == 0);
+
+    joypad_response_unpack(&r, resp, 4);
+    CHECK(r.c_x == 0x56 && r.c_y == 0x78);
+    CHECK(r.l == 0 && r.r == 0 && r.a == 0x9a && r.b == 0xbc);
+}
+
+static void test_report_transform(void)
+{
+    static uint8_t luts[STICK_AXES][256];
+    struct joypad_report origin = {
+        .joy_x = 128, .joy_y = 128, .c_x = 100, .c_y = 150,
+        .l = 30, .r = 30,
+    };
+    struct joypad_report src, dst;
+    unsigned int i;
+
+    /* The defaults pass the distance from the origin through as is */
+    for (i = 0; i < STICK_AXES; ++i)
+        stick_lut_build(luts[i], 0, 127, i & 1);
+    for (i = 0; i < 256; ++i) {
+        src = origin;
+        src.joy_x = i;
+        src.joy_y = i;
+        joypad_report_transform(&dst, &src, &origin, luts);
+        if (i == 0) {
+            /* Full deflection clamps at 127 */
+            CHECK(dst.joy_x == (uint8_t)-127 && dst.joy_y == 127);
+        } else if (!CHECK(dst.joy_x == (uint8_t)(i - 128) &&
+                          dst.joy_y == (uint8_t)(128 - i))) {
+            printf("  joy %u\n", i);
+            break;
+        }
+    }
+
+    /* Deadzone and range */
+    stick_lut_build(luts[2], 10, 100, 0);
+    stick_lut_build(luts[3], 10, 100, 1);
+    src = origin;
+    src.c_x = origin.c_x + 10;
+    src.c_y = origin.c_y - 10;
+    joypad_report_transform(&dst, &src, &origin, luts);
+    CHECK(dst.c_x == 0 && dst.c_y == 0);
+    src.c_x = origin.c_x + 55;
+    src.c_y = origin.c_y + 55;
+    joypad_report_transform(&dst, &src, &origin, luts);
+    CHECK(dst.c_x == 63 && dst.c_y == (uint8_t)-63);
+    src.c_x = origin.c_x - 100;
+    src.c_y = origin.c_y + 105;
+    joypad_report_transform(&dst, &src, &origin, luts);
+    CHECK(dst.c_x == (uint8_t)-127 && dst.c_y == (uint8_t)-127);
+
+    /* More than 127 from an off centre origin stays on its side */
+    for (i = 0; i < STICK_AXES; ++i)
+        stick_lut_build(luts[i], 0, 127, 0);
+    src = origin;
+    src.c_x = origin.c_x + 150;
+    src.c_y = origin.c_y - 150;
+    joypad_report_transform(&dst, &src, &origin, luts);
+    CHECK(dst.c_x == 127 && dst.c_y == (uint8_t)-127);
+
+    /* The triggers are offset by their origin and don't go below zero */
+    src = origin;
+    src.l = 50;
+    src.r = 20;
+    src.a = 77;
+    src.b = 88;
+    src.buttons_0 = 0x11;
+    src.buttons_1 = 0x82;
+    joypad_report_transform(&dst, &src, &origin, luts);
+    CHECK(dst.l == 20 && dst.r == 0);
+    CHECK(dst.a == 77 && dst.b == 88);
+    CHECK(dst.buttons_0 == 0x11 && dst.buttons_1 == 0x82);
+}
+
+#if REPORT_ON_CHANGE
+static void test_report_changed(void)
+{
+    static struct joypad joypad;
+    struct joypad_report r = { 0 };
+
+    joypad.last_sent = r;
+    CHECK(!joypad_report_changed(&joypad, &r));
+    r.buttons_1 = 0x01;
+    CHECK(joypad_report_changed(&joypad, &r));
+
+    /* Changes up to the threshold are noise */
+    r = joypad.last_sent;
+    r.joy_x = REPORT_STICK_THRESHOLD;
+    r.l = REPORT_TRIGGER_THRESHOLD;
+    CHECK(!joypad_report_changed(&joypad, &r));
+    r.joy_x = -(REPORT_STICK_THRESHOLD + 1);
+    CHECK(joypad_report_changed(&joypad, &r));
+    r = joypad.last_sent;
+    r.l = REPORT_TRIGGER_THRESHOLD + 1;
+    CHECK(joypad_report_changed(&joypad, &r));
+
+    /* Full scale swings must not wrap around to small ones */
+    joypad.last_sent.c_y = 127;
+    r = joypad.last_sent;
+    r.c_y = (uint8_t)-127;
+    CHECK(joypad_report_changed(&joypad, &r));
+    joypad.last_sent.c_y = 0;
+    joypad.last_sent.r = 0;
+    r = joypad.last_sent;
+    r.r = 255;
+    CHECK(joypad_report_changed(&joypad, &r));
+    joypad.last_sent.b = 255;
+    r = joypad.last_sent;
+    r.b = 0;
+    CHECK(joypad_report_changed(&joypad, &r));
+}
+#endif
+
+static int8_t find_descriptor(uint8_t type, uint8_t idx, uint16_t index,
+                              struct usb_descriptor *desc)
+{
+    struct usb_request req = {
+        .request_type = 0x80,
+        .request = USB_REQ_GET_DESCRIPTOR,
+        .value = type<<8 | idx,
+        .index = index,
+    };
+
+    return usb_find_descriptor(&req, desc);
+}
+
+static void test_find_descriptor(void)
+{
+    struct usb_descriptor desc;
+    const uint8_t *d;
+    uint8_t i;
+
+    CHECK(!find_descriptor(USB_DESC_TYPE_DEVICE, 0, 0, &desc));
+    d = desc.data;
+    CHECK(desc.data_sz == 18 && d[0] == 18 && d[1] == USB_DESC_TYPE_DEVICE);
+
+    CHECK(!find_descriptor(USB_DESC_TYPE_CONFIGURATION, 0, 0, &desc));
+    d = desc.data;
+    CHECK(d[1] == USB_DESC_TYPE_CONFIGURATION);
+    CHECK(desc.data_sz == (d[2] | d[3]<<8));
+    CHECK(d[4] == CONTROLLER_PORTS);
+    CHECK(find_descriptor(USB_DESC_TYPE_CONFIGURATION, 1, 0, &desc));
+
+    for (i = 0; i < ARRAY_LEN(string_descriptors); ++i) {
+        CHECK(!find_descriptor(USB_DESC_TYPE_STRING, i, 0, &desc));
+        d = desc.data;
+        CHECK(d[0] == desc.data_sz && d[1] == USB_DESC_TYPE_STRING);
+    }
+    CHECK(find_descriptor(USB_DESC_TYPE_STRING, i, 0, &desc));
+    /* Only US English, and the strings without a terminator */
+    CHECK(!find_descriptor(USB_DESC_TYPE_STRING, STRING_DESC_IDX_LANG, 0,
+                           &desc));
+    d = desc.data;
+    CHECK(desc.data_sz == 4 && d[2] == 0x09 && d[3] == 0x04);
+    CHECK(!find_descriptor(USB_DESC_TYPE_STRING, STRING_DESC_IDX_PROD, 0,
+                           &desc));
+    CHECK(desc.data_sz == 2 + 2 * 4);
+
+    for (i = 0; i < CONTROLLER_PORTS; ++i) {
+        CHECK(!find_descriptor(USB_DESC_TYPE_REPORT, 0, i, &desc));
+        CHECK(desc.data == joypad_report_desc &&
+              desc.data_sz == sizeof(joypad_report_desc));
+    }
+    CHECK(find_descriptor(USB_DESC_TYPE_REPORT, 0, CONTROLLER_PORTS, &desc));
+
+    CHECK(find_descriptor(USB_DESC_TYPE_ENDPOINT, 0, 0, &desc));
+    CHECK(find_descriptor(USB_DESC_TYPE_HID, 0, 0, &desc));
+}
+
+/* Called by the timer in the firmware */
+void TIMER3_COMPA_vect(void);
+
+/* The ports with a controller, and how many poll responses come corrupted */
+static uint8_t test_connected;
+static uint8_t test_glitches;
+static uint16_t test_sof;
+static uint8_t test_probe;
+
+/* Standard controllers at rest on the ports in test_connected */
+static uint8_t test_controller(uint8_t port, const uint8_t *tx,
+                               uint8_t tx_len, uint8_t *rx, uint8_t rx_len)
+{
+    if (!(test_connected & (1<<port)))
+        return 0;
+
+    switch (tx[0]) {
+    case JOYBUS_CMD_PROBE:
+        rx[0] = JOYBUS_ID0_GC | JOYBUS_ID0_STANDARD;
+        rx[1] = 0;
+        rx[2] = 0;
+        return JOYBUS_PROBE_BYTES;
+    case JOYBUS_CMD_POLL:
+    case JOYBUS_CMD_ORIGIN:
+        memset(rx, 0, rx_len);
+        rx[1] = 0x80;
+        memset(&rx[2], 128, 4);
+        /* Tells the origin from the default one */
+        if (tx[0] == JOYBUS_CMD_ORIGIN)
+            rx[2] = 130;
+        /* A fixed bit that is never set */
+        if (tx[0] == JOYBUS_CMD_POLL && test_glitches) {
+            --test_glitches;
+            rx[0] |= 0x40;
+        }
+        return rx_len;
+    }
+    return 0;
+}
+
+/* All the ports disconnected, probed in the first frame */
+static void test_slots_reset(uint8_t connected)
+{
+    uint8_t port;
+
+    memset(joypads, 0, sizeof(joypads));
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        joypads[port].origin = joypad_origin_default;
+        joypads[port].probe_backoff = PROBE_BACKOFF_MIN_MS;
+        joypads[port].probe_wait = 1;
+    }
+    test_connected = connected;
+    test_glitches = 0;
+    test_probe = 0;
+    mock_controller = test_controller;
+}
+
+/*
+ * A frame of the main loop with its time on TCNT3: the SOF, the probes in the
+ * idle time after it and the poll slot at the compare match. The poll must
+ * end before the next SOF.
+ */
+static void test_frame(void)
+{
+    test_sof += SCHED_FRAME_TICKS;
+    CHECK((int16_t)(test_sof - TCNT3) >= 0);
+    TCNT3 = test_sof;
+    ++UDFNUML;
+    sched_sof();
+
+    if (!sched_wait() && test_probe)
+        test_probe = joypad_probe(test_probe);
+    if (TIMSK3 & (1<<OCIE3A)) {
+        CHECK((int16_t)(OCR3A - TCNT3) >= 0);
+        TCNT3 = OCR3A;
+        TIMER3_COMPA_vect();
+    }
+    if (CHECK(sched_wait()))
+        test_probe = joypad_poll_slot(test_probe);
+}
+
+/*
+ * A retry doesn't fit in the time a settled poll leaves, but a corrupted
+ * response budgets one, and the next ones get it
+ */
+static void test_poll_retry(void)
+{
+    uint16_t retries, seq;
+    unsigned int i;
+
+    test_slots_reset(1<<0);
+    for (i = 0; i < 100; ++i)
+        test_frame();
+    CHECK(joypads[0].state == JOYPAD_CONNECTED);
+    CHECK(joypads[1].state == JOYPAD_ABSENT);
+
+    retries = poll_stats.retries;
+    seq = joypads[0].report_seq;
+    test_glitches = 1;
+    test_frame();
+    CHECK(poll_stats.retries == retries);
+    CHECK(joypads[0].report_seq == seq);
+
+    for (i = 0; i < 20; ++i) {
+        retries = poll_stats.retries;
+        seq = joypads[0].report_seq;
+        test_glitches = 1;
+        test_frame();
+        CHECK(poll_stats.retries == retries + 1);
+        CHECK(joypads[0].report_seq == seq + 1);
+    }
+
+    /* Back to the settled lead without glitches */
+    for (i = 0; i < 100; ++i)
+        test_frame();
+    retries = poll_stats.retries;
+    test_glitches = 1;
+    test_frame();
+    CHECK(poll_stats.retries == retries);
+
+    mock_controller = NULL;
+}
+
+/*
+ * Controllers plugged into all the ports at once get their origins read in
+ * the poll slots and are polled in every slot from then on
+ */
+static void test_connect_all(void)
+{
+    uint16_t seq[CONTROLLER_PORTS];
+    uint8_t port;
+    unsigned int i;
+
+    test_slots_reset((1<<CONTROLLER_PORTS) - 1);
+    for (i = 0; i < 10; ++i)
+        test_frame();
+    for (port = 0; port < CONTROLLER_PORTS; ++port) {
+        CHECK(joypads[port].state == JOYPAD_CONNECTED);
+        CHECK(joypads[port].origin.joy_x == 130);
+        seq[port] = joypads[port].report_seq;
+    }
+
+    for (i = 0; i < 100; ++i)
+        test_frame();
+    for (port = 0; port < CONTROLLER_PORTS; ++port)
+        CHECK(joypads[port].report_seq == seq[port] + 100);
+
+    /* Plugged in again next to one that is polled */
+    test_connected = 1<<0;
+    for (i = 0; i < 20; ++i)
+        test_frame();
+    CHECK(joypads[1].state == JOYPAD_ABSENT);
+    joypads[1].origin = joypad_origin_default;
+    test_connected = (1<<CONTROLLER_PORTS) - 1;
+    for (i = 0; i < PROBE_BACKOFF_MAX_MS + 3; ++i)
+        test_frame();
+    CHECK(joypads[1].state == JOYPAD_CONNECTED);
+    CHECK(joypads[1].origin.joy_x == 130);
+
+    mock_controller = NULL;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "decode_table",       test_decode_table },
+    { "decode_state",       test_decode_state },
+    { "unslice",            test_unslice },
+    { "decode_edges",       test_decode_edges },
+    { "decode_icp",         test_decode_icp },
+    { "response_check",     test_response_check },
+    { "response_unpack",    test_response_unpack },
+    { "report_transform",   test_report_transform },
+#if REPORT_ON_CHANGE
+    { "report_changed",     test_report_changed },
+#endif
+    { "find_descriptor",    test_find_descriptor },
+    { "poll_retry",         test_poll_retry },
+    { "connect_all",        test_connect_all },
+};
+
+int main(void)
+{
+    unsigned int i, before;
+
+    for (i = 0; i < ARRAY_LEN(tests); ++i) {
+        before = failures;
+        tests[i].run();
+        printf("%-20s %s\n", tests[i].name,
+               failures == before ? "ok" : "FAILED");
+    }
+    printf("%u checks, %u failed\n", checks, failures);
+
+    return failures != 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Defines the registers declared in the mock avr/io.h */
+#define MOCK_REG(type, name) volatile type name;
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#include "controller.h"
+#include "debug.h"
+#include "iodefs.h"
+#include "sched.h"
+
+#include "mock.h"
+#include "samples.h"
+
+/* The EEMEM variables are in RAM, which is enough for calib.c */
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+    return *p;
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t v)
+{
+    *p = v;
+}
+
+/* The serial console goes to stderr */
+void led_init(void) {}
+void usart_init(void) {}
+void stdio_init(void) {}
+
+void debug_log(const char *fmt, uint8_t n, ...)
+{
+    fprintf(stderr, "debug_log: %s", fmt);
+}
+
+void debug_poll(void) {}
+
+void debug_putc_sync(char c)
+{
+    fputc(c, stderr);
+}
+
+void halt(void)
+{
+    fprintf(stderr, "halt\n");
+    abort();
+}
+
+/* controller.S, no controller answers unless a test sets one up */
+mock_controller_fn mock_controller;
+
+/* Asks the controller of the port and moves TCNT3 past the transfer */
+static uint8_t mock_transfer(uint8_t port, const void *tx, uint8_t tx_len,
+                             uint8_t *rx, uint8_t rx_len)
+{
+    uint8_t n = 0;
+    uint16_t us;
+
+    if (mock_controller)
+        n = mock_controller(port, tx, tx_len, rx, rx_len);
+    /* 4 us bits with the stop bits, or the wait for a response */
+    us = (tx_len * 8 + 1) * 4;
+    us += n ? (n * 8 + 1) * 4 : JOYBUS_TIMEOUT_US;
+    TCNT3 += us * SCHED_TICKS_PER_US;
+
+    return n;
+}
+
+uint8_t joybus_transfer(uint8_t port, const void *tx, uint8_t tx_len,
+                        void *rx, uint8_t rx_len)
+{
+    uint8_t n = mock_transfer(port, tx, tx_len, rx, rx_len);
+
+    return n ? n | JOYBUS_RX_STOP : 0;
+}
+
+void joybus_transfer_raw(uint8_t port, const void *tx, uint8_t tx_len,
+                         void *buf, uint8_t sz)
+{
+    uint8_t resp[CONTROLLER_POLL_BYTES];
+
+    if (mock_transfer(port, tx, tx_len, resp, sz / 4))
+        samples_oversample(resp, sz / 4, buf, 0);
+    else
+        memset(buf, 0xff, sz);
+}
+
+uint8_t controller_poll_sliced(uint8_t *slices, uint8_t follow)
+{
+    memset(slices, 0xff, CONTROLLER_SLICES);
+    return CONTROLLER_DATA_MASK;
+}
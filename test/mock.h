@@ -0,0 +1,18 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stdint.h>
+
+/*
+ * The controllers behind the controller.S mock in mock.c. Set by a test to
+ * answer the commands: stores the response to rx and returns its length, 0
+ * if nothing answers. Every transfer moves TCNT3 on by its time on the wire,
+ * so the scheduler sees the polls take their time.
+ */
+typedef uint8_t (*mock_controller_fn)(uint8_t port, const uint8_t *tx,
+                                      uint8_t tx_len, uint8_t *rx,
+                                      uint8_t rx_len);
+
+extern mock_controller_fn mock_controller;
+
+#endif
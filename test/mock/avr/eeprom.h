@@ -0,0 +1,15 @@
+#ifndef MOCK_AVR_EEPROM_H
+#define MOCK_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The EEPROM is plain memory, which starts out erased in mock.c */
+#define EEMEM
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+uint8_t eeprom_read_byte(const uint8_t *p);
+void eeprom_update_byte(uint8_t *p, uint8_t v);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef MOCK_AVR_INTERRUPT_H
+#define MOCK_AVR_INTERRUPT_H
+
+/* The vectors become plain functions that a test can call */
+#define ISR(vector) void vector(void); void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void) {}
+#define sei() ((void)0)
+#define cli() ((void)0)
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef MOCK_AVR_IO_H
+#define MOCK_AVR_IO_H
+
+/*
+ * Just enough of the atmega32u4 registers for the firmware to compile on the
+ * host. The registers are plain variables, defined in mock.c, and nothing
+ * happens when they are written.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef MOCK_REG
+#define MOCK_REG(type, name) extern volatile type name;
+#endif
+
+/* PIN, DDR and PORT are next to each other, see PORT() in iodefs.h */
+MOCK_REG(uint8_t, mock_portb[3])
+MOCK_REG(uint8_t, mock_portc[3])
+MOCK_REG(uint8_t, mock_portd[3])
+MOCK_REG(uint8_t, mock_portf[3])
+#define PINB mock_portb[0]
+#define DDRB mock_portb[1]
+#define PORTB mock_portb[2]
+#define PINC mock_portc[0]
+#define DDRC mock_portc[1]
+#define PORTC mock_portc[2]
+#define PIND mock_portd[0]
+#define DDRD mock_portd[1]
+#define PORTD mock_portd[2]
+#define PINF mock_portf[0]
+#define DDRF mock_portf[1]
+#define PORTF mock_portf[2]
+
+#define MOCK_REG8(name) MOCK_REG(uint8_t, name)
+#define MOCK_REG16(name) MOCK_REG(uint16_t, name)
+
+MOCK_REG8(SREG) MOCK_REG8(CLKPR) MOCK_REG8(MCUSR) MOCK_REG8(WDTCSR)
+MOCK_REG8(UHWCON) MOCK_REG8(USBCON) MOCK_REG8(PLLCSR) MOCK_REG8(UDCON)
+MOCK_REG8(UDIEN) MOCK_REG8(UDINT) MOCK_REG8(UDADDR) MOCK_REG8(UDFNUML)
+MOCK_REG8(UENUM) MOCK_REG8(UERST) MOCK_REG8(UECONX) MOCK_REG8(UECFG0X)
+MOCK_REG8(UECFG1X) MOCK_REG8(UEINTX) MOCK_REG8(UEIENX) MOCK_REG8(UEDATX)
+MOCK_REG8(UEINT)
+MOCK_REG8(UCSR1A) MOCK_REG8(UCSR1B) MOCK_REG8(UCSR1C) MOCK_REG8(UDR1)
+MOCK_REG16(UBRR1)
+MOCK_REG8(TCCR1A) MOCK_REG8(TCCR1B) MOCK_REG8(TIMSK1) MOCK_REG8(TIFR1)
+MOCK_REG16(TCNT1) MOCK_REG16(ICR1)
+MOCK_REG8(TCCR3A) MOCK_REG8(TCCR3B) MOCK_REG8(TIMSK3) MOCK_REG8(TIFR3)
+MOCK_REG16(TCNT3) MOCK_REG16(OCR3A)
+MOCK_REG8(SPCR) MOCK_REG8(SPSR) MOCK_REG8(SPDR)
+
+enum {
+    /* USB */
+    UVREGE = 0, USBE = 7, FRZCLK = 5, OTGPADE = 4, PINDIV = 4, PLLE = 1,
+    PLOCK = 0, DETACH = 0, RMWKUP = 1,
+    SUSPE = 0, SOFE = 2, EORSTE = 3, WAKEUPE = 4,
+    SUSPI = 0, SOFI = 2, EORSTI = 3, WAKEUPI = 4,
+    ADDEN = 7, EPEN = 0, STALLRQC = 4, STALLRQ = 5,
+    EPDIR = 0, EPTYPE0 = 6, ALLOC = 1, EPBK0 = 2, EPSIZE0 = 4, EPSIZE1 = 5,
+    TXINI = 0, STALLEDI = 1, RXOUTI = 2, RXSTPI = 3, NAKOUTI = 4, RWAL = 5,
+    FIFOCON = 7, TXINE = 0, RXSTPE = 3,
+    /* USART1 */
+    U2X1 = 1, UDRE1 = 5, TXEN1 = 3, RXEN1 = 4, UDRIE1 = 5, UCSZ10 = 1,
+    UCSZ11 = 2,
+    /* Timers */
+    CS10 = 0, CS11 = 1, ICES1 = 6, ICNC1 = 7, ICIE1 = 5, ICF1 = 5,
+    CS30 = 0, CS31 = 1, OCIE3A = 1, OCF3A = 1,
+    /* SPI */
+    SPR0 = 0, SPR1 = 1, CPHA = 2, CPOL = 3, MSTR = 4, DORD = 5, SPE = 6,
+    SPIE = 7, SPI2X = 0, SPIF = 7,
+    /* Watchdog */
+    WDP0 = 0, WDP1 = 1, WDP2 = 2, WDE = 3, WDCE = 4, WDP3 = 5, WDIE = 6,
+    WDRF = 3,
+};
+
+#endif
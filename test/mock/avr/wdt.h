@@ -0,0 +1,6 @@
+#ifndef MOCK_AVR_WDT_H
+#define MOCK_AVR_WDT_H
+
+#define wdt_reset() ((void)0)
+
+#endif
@@ -0,0 +1,100 @@
+#include "samples.h"
+
+static uint32_t samples_state = 1;
+
+/* xorshift32, the same sequence on every run */
+uint32_t samples_rand(void)
+{
+    uint32_t x = samples_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return samples_state = x;
+}
+
+/* A random poll response with the fixed bits right */
+void samples_response(uint8_t *resp, uint8_t len)
+{
+    uint8_t i;
+
+    for (i = 0; i < len; ++i)
+        resp[i] = samples_rand();
+    resp[0] &= ~0xc0;
+    resp[1] |= 0x80;
+}
+
+/*
+ * Four samples per bit, the first one in the high bit of the nibble and the
+ * first bit in the high nibble. The line is low for the first sample and high
+ * for the last one, the middle two tell the bit. With noise, the first or the
+ * last sample of a random bit is flipped every now and then, which the
+ * weighting must ride over.
+ */
+void samples_oversample(const uint8_t *resp, uint8_t len, uint8_t *buf,
+                        uint8_t noise)
+{
+    uint8_t i, j, bit, nibble;
+
+    for (i = 0; i < len; ++i) {
+        for (j = 0; j < 8; ++j) {
+            bit = (resp[i] >> (7 - j)) & 1;
+            nibble = bit ? 0x7 : 0x1;
+            if (noise && !(samples_rand() & 3))
+                nibble ^= (samples_rand() & 1) ? 0x8 : 0x1;
+            if (j & 1)
+                *buf++ |= nibble;
+            else
+                *buf = nibble << 4;
+        }
+    }
+}
+
+/*
+ * One byte per response bit and the stop bit, the bit of each port at the
+ * bit position of its data line, as controller_poll_sliced() stores them.
+ * The lines not in bits read high, like lines without a controller.
+ */
+void samples_slice(const uint8_t *const *resps, const uint8_t *bits,
+                   uint8_t ports, uint8_t len, uint8_t *slices)
+{
+    uint8_t i, port, other = 0xff;
+
+    for (port = 0; port < ports; ++port)
+        other &= ~(1 << bits[port]);
+
+    for (i = 0; i < len * 8; ++i) {
+        slices[i] = other;
+        for (port = 0; port < ports; ++port) {
+            if ((resps[port][i / 8] >> (7 - i % 8)) & 1)
+                slices[i] |= 1 << bits[port];
+        }
+    }
+    /* The stop bit */
+    slices[len * 8] = 0xff;
+}
+
+/*
+ * The low bytes of the timer at the rising edges of the response bits and
+ * the stop bit, as the input capture stores them. bit_time is in ticks and
+ * the controller's clock is off by skew_permille. Returns the number of
+ * edges.
+ */
+uint8_t samples_edges(const uint8_t *resp, uint8_t len, uint16_t bit_time,
+                      int16_t skew_permille, uint8_t *edges)
+{
+    uint32_t bit = (uint32_t)bit_time * (1000 + skew_permille);
+    uint32_t t = 1000 * (uint32_t)(samples_rand() & 0xff);
+    uint8_t i;
+
+    for (i = 0; i < len * 8; ++i) {
+        if ((resp[i / 8] >> (7 - i % 8)) & 1)
+            edges[i] = (t + bit / 4) / 1000;
+        else
+            edges[i] = (t + 3 * bit / 4) / 1000;
+        t += bit;
+    }
+    edges[i++] = (t + bit / 4) / 1000;
+
+    return i;
+}
@@ -0,0 +1,21 @@
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+#include <stdint.h>
+
+/*
+ * Synthetic receiver input for the host tests and benchmarks, built from
+ * known responses the way the receivers in controller.S and controller_icp.c
+ * see them.
+ */
+
+uint32_t samples_rand(void);
+void samples_response(uint8_t *resp, uint8_t len);
+void samples_oversample(const uint8_t *resp, uint8_t len, uint8_t *buf,
+                        uint8_t noise);
+void samples_slice(const uint8_t *const *resps, const uint8_t *bits,
+                   uint8_t ports, uint8_t len, uint8_t *slices);
+uint8_t samples_edges(const uint8_t *resp, uint8_t len, uint16_t bit_time,
+                      int16_t skew_permille, uint8_t *edges);
+
+#endif
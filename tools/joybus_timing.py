@@ -0,0 +1,1083 @@
+#!/usr/bin/env python3
+"""
+Checks the cycle timing of the Joybus routines in controller.S by running
+their instructions on a small AVR model:
+
+    joybus_timing.py [--mhz 16 8] [--polls 200]
+
+controller.S is read as written: the #if blocks are evaluated with the
+defines of iodefs.h and controller.h for each build checked, the macros are
+expanded, and the delay and nopn macros are counted as the cycles they burn,
+so a change to the code or to a delay count shows up here. The data lines
+are modeled as open drain: low when the DDR bit pulls them down or when the
+simulated controller does.
+
+The cycles labelled on the lines of controller.S, like "/* 1(2), 5 / 16 */",
+are checked first against the cycles the model counts for the same lines at
+16 MHz, so the labels and the model can't drift apart: the first number is
+the line's own cycles, the other way of a branch in parentheses, and a call
+is counted through the ret of the function it calls.
+
+Checked for every clock, with one port:
+
+    tx      joybus_tx: the low time of every bit sent is exactly one
+            microsecond for a one and three for a zero, the stop bit one,
+            and every bit is exactly four microseconds
+    rx      joybus_rx: the responses of controllers with up to 5% clock
+            skew are received right, with the stop bit, and every bit is
+            sampled at least a quarter microsecond away from where a one and
+            a zero rise
+    cli     the time from cli to the restored SREG stays within the time
+            on the wire plus JOYBUS_END_US to see the end of the response
+            and OVERHEAD_US of setup, or within JOYBUS_TIMEOUT_US when the
+            controller doesn't answer
+
+With four ports, for the clocks the bit sliced routines are built for:
+
+    sliced tx   controller_poll_sliced: the same bit widths on every line,
+                with the rumble byte of each port, give or take the
+                SLICED_JITTER cycles the register loop leaves
+    sliced rx   the responses on all the lines, with the same clock up to
+                5% off, are received right and none is reported late when
+                each starts up to LATE_OK_US after the first, lines
+                starting later are either reported late or received right,
+                and the lines without a controller are reported late
+    sliced drift
+                the same for clocks up to SLICED_SKEW apart and the lines
+                starting up to DRIFT_LATE_US apart
+    sliced skew the responses of controllers with up to SLICED_SKEWS clock
+                skew are either reported late or received right, and over
+                SLICED_RUN polls that follow the reported ports in turn
+                like main.c, a controller reported is received right again
+                within CONTROLLER_PORTS polls
+
+With CONTROLLER_SPI=1:
+
+    spi         joybus_stop_rx: the stop bit that ends a command sent with the
+                SPI is low for exactly one microsecond, and the responses of
+                controllers answering 1 to 4 us after it with up to 5% clock
+                skew are received right, as with joybus_transfer
+
+With CONTROLLER_RAW_SAMPLES=1, for the clocks it's built for:
+
+    raw         joybus_transfer_raw: the samples are exactly a microsecond
+                apart and decode to the response with the 1-2-2-1 rule
+
+Prints a line per check and exits with 1 if any of them fails.
+"""
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+# joybus_rx gives up after six microseconds without an edge
+JOYBUS_END_US = 6
+# Calls, register setup and the checks around the bits
+OVERHEAD_US = 3
+# Sample margin from the rising edges of a one and a zero
+MARGIN_US = 0.25
+# The raw samples receiver doesn't follow the clock of the controller
+FIXED_SKEW = 0.002
+# The sliced receiver follows the first line, the others may drift from it
+SLICED_SKEW = 0.0025
+DRIFT_LATE_US = 0.3
+# and are reported when they drift off the phase, the ports then followed in
+# turn over runs of SLICED_RUN polls
+SLICED_SKEWS = (0.01, 0.02, 0.05)
+SLICED_RUN = 8
+# How much later than the first a line may answer and still be received
+LATE_OK_US = 0.9
+# The first and last bit of the register loop of the sliced sender
+SLICED_JITTER = 1
+
+CYCLES = {
+    'tst': 1, 'in': 1, 'out': 1, 'mov': 1, 'movw': 1, 'or': 1, 'and': 1,
+    'andi': 1, 'ori': 1, 'com': 1, 'ldi': 1, 'lsl': 1, 'dec': 1, 'neg': 1,
+    'rol': 1, 'cp': 1, 'cpi': 1, 'sub': 1, 'nop': 1, 'cli': 1, 'sei': 1,
+    'set': 1, 'clt': 1, 'sec': 1, 'clc': 1, 'bst': 1, 'bld': 1,
+    'ld': 2, 'st': 2, 'lds': 2, 'sts': 2, 'sbiw': 2,
+    'push': 2, 'pop': 2, 'rjmp': 2, 'rcall': 3, 'call': 4, 'ret': 4,
+}
+# One cycle more when taken
+BRANCHES = ('breq', 'brne', 'brcc', 'brcs', 'brts', 'brtc')
+
+# The cycle label of a line: its cycles, with the other way of a branch or a
+# skip in parentheses, and a call as the call plus the function it calls,
+# optionally followed by a comma and the position in the bit
+LABEL = re.compile(r'(\d+)(?:\((\d+)\))?((?:\s*\+\s*\d+)*)'
+                   r'(?:\s*=\s*(\d+))?(?:\s+cycles)?$')
+
+
+class ConfigError(Exception):
+    """An #error of controller.S, the build isn't supported"""
+
+
+def read(name, rev=None):
+    """A file of the tree, or as it was in the git revision rev"""
+    if rev is not None:
+        return subprocess.run(['git', 'show', '%s:%s' % (rev, name)],
+                              cwd=ROOT, stdout=subprocess.PIPE, check=True,
+                              universal_newlines=True).stdout
+    with open(os.path.join(ROOT, name)) as f:
+        return f.read()
+
+
+class Names:
+    """The defines, evaluated when looked up, undefined names are zero"""
+
+    def __init__(self, prog):
+        self.prog = prog
+
+    def __getitem__(self, name):
+        if name in ('lo8', 'hi8'):
+            return {'lo8': lambda v: v & 0xff,
+                    'hi8': lambda v: (v >> 8) & 0xff}[name]
+        if name not in self.prog.defs:
+            return 0
+        return self.prog.value(self.prog.defs[name])
+
+
+class Program:
+    """
+    controller.S for one build, preprocessed and with the macros expanded,
+    from the tree or from the git revision rev
+    """
+
+    def __init__(self, mhz, ports=1, raw=0, spi=0, rev=None):
+        self.defs = {
+            '__ASSEMBLER__': '1', 'F_CPU': '%d' % (mhz * 1000000),
+            'CONTROLLER_PORTS': str(ports), 'CONTROLLER_RAW_SAMPLES': str(raw),
+            'CONTROLLER_SPI': str(spi),
+        }
+        self.names = Names(self)
+        self.preprocess(read('iodefs.h', rev))
+        self.preprocess(read('controller.h', rev))
+        lines = self.preprocess(read('controller.S', rev))
+
+        self.macros = {}
+        body = None
+        top = []
+        for line in lines:
+            s = line.strip()
+            if body is not None:
+                if s == '.endm':
+                    body = None
+                else:
+                    body.append(s)
+                continue
+            m = re.match(r'\.macro\s+(\w+)\s*(.*)$', s)
+            if m:
+                params = [p.strip() for p in m.group(2).split(',')
+                          if p.strip()]
+                body = []
+                self.macros[m.group(1)] = (params, body)
+            else:
+                top.append(s)
+
+        self.code = []
+        self.labels = []
+        self.funcs = {}
+        self.func = None
+        for s in top:
+            self.add(s, ())
+
+    @staticmethod
+    def cexpr(expr):
+        expr = re.sub(r'\b(0x[0-9a-fA-F]+|\d+)[uUlL]+\b', r'\1', expr)
+        expr = expr.replace('&&', ' and ').replace('||', ' or ')
+        expr = re.sub(r'!(?!=)', ' not ', expr)
+        return re.sub(r'(?<!/)/(?!/)', '//', expr)
+
+    def value(self, expr):
+        expr = re.sub(r'defined\s*\(?\s*(\w+)\s*\)?',
+                      lambda m: '1' if m.group(1) in self.defs else '0', expr)
+        return int(eval(self.cexpr(expr), {'__builtins__': {}}, self.names))
+
+    def preprocess(self, text):
+        """Evaluates the #if blocks and #defines, returns the other lines"""
+        text = re.sub(r'/\*.*?\*/', ' ', text, flags=re.S)
+        text = text.replace('\\\n', ' ')
+        out, stack = [], []
+        for line in text.splitlines():
+            s = line.strip()
+            active = all(a for a, _ in stack)
+            if not s.startswith('#'):
+                if active:
+                    out.append(s)
+                continue
+            d, _, rest = s[1:].strip().partition(' ')
+            rest = rest.strip()
+            if d in ('if', 'ifdef', 'ifndef'):
+                if not active:
+                    v = False
+                elif d == 'if':
+                    v = bool(self.value(rest))
+                else:
+                    v = (rest in self.defs) == (d == 'ifdef')
+                stack.append([v, v])
+            elif d in ('elif', 'else'):
+                top = stack[-1]
+                parent = all(a for a, _ in stack[:-1])
+                v = parent and not top[1] and (d == 'else' or
+                                              bool(self.value(rest)))
+                top[0] = v
+                top[1] |= v
+            elif d == 'endif':
+                stack.pop()
+            elif not active:
+                pass
+            elif d == 'define':
+                m = re.match(r'(\w+)(\(?)\s*(.*)$', rest)
+                if not m.group(2):
+                    self.defs[m.group(1)] = m.group(3) or '1'
+            elif d == 'undef':
+                self.defs.pop(rest, None)
+            elif d == 'error':
+                raise ConfigError(rest.strip('"'))
+        return out
+
+    def io(self, name):
+        """The register an I/O operand names"""
+        name = re.sub(r'_SFR_IO_ADDR\((\w+)\)', r'\1', name)
+        while re.match(r'\w+$', self.defs.get(name, '')):
+            name = self.defs[name]
+        return name
+
+    def add(self, line, tags):
+        if not line:
+            return
+        m = re.match(r'\.equ\s+(\w+)\s*,\s*(.*)$', line)
+        if m:
+            self.defs[m.group(1)] = m.group(2)
+            return
+        if line.startswith('.'):
+            return
+        m = re.match(r'(\w+):\s*(.*)$', line)
+        if m:
+            if m.group(1).isdigit():
+                self.labels.append((m.group(1), len(self.code)))
+            else:
+                self.funcs[m.group(1)] = len(self.code)
+                self.func = m.group(1)
+            line = m.group(2)
+            if not line:
+                return
+        m = re.match(r'(delay|nopn)\s*(.*)$', line)
+        if m:
+            n = self.value(m.group(2).strip('"'))
+            if n < 0:
+                raise ConfigError('negative delay: ' + line)
+            self.code.append(('delay', [n], tags, self.func))
+            return
+        op, _, args = line.partition(' ')
+        args = [a.strip() for a in args.split(',')] if args.strip() else []
+        if op in self.macros:
+            params, body = self.macros[op]
+            for bline in body:
+                for p, a in sorted(zip(params, args), key=lambda x: -len(x[0])):
+                    bline = bline.replace('\\' + p, a)
+                self.add(bline.replace('\\()', ''), tags + (op,))
+            return
+        self.code.append((op, args, tags, self.func))
+
+    def expand(self, line):
+        """The code of a single line, which isn't added to the program"""
+        saved = self.code, self.labels, self.funcs, self.func
+        self.code, self.labels, self.funcs = [], [], dict(self.funcs)
+        try:
+            self.add(line, ())
+            return self.code
+        finally:
+            self.code, self.labels, self.funcs, self.func = saved
+
+    def target(self, pc, ref):
+        """The address of a function or a local label reference like 1b"""
+        if ref in self.funcs:
+            return self.funcs[ref]
+        name, way = ref[:-1], ref[-1]
+        if way == 'b':
+            return max(a for n, a in self.labels if n == name and a <= pc)
+        return min(a for n, a in self.labels if n == name and a > pc)
+
+    def data_bits(self):
+        return [self.names['CONTROLLER_DATA_BIT%d' % i]
+                for i in range(self.names['CONTROLLER_PORTS'])]
+
+
+class Controller:
+    """
+    The response of a controller as the times its line is pulled down, every
+    edge off by a normal jitter in microseconds drawn from rng
+    """
+
+    def __init__(self, mhz, data, skew, delay_us, stop=True, jitter=0.0,
+                 rng=None):
+        self.mhz = mhz
+        self.bits = [(b >> (7 - i)) & 1 for b in data for i in range(8)]
+        if stop:
+            self.bits.append(1)
+        self.skew = skew
+        self.delay_us = delay_us
+        self.jitter = jitter
+        self.rng = rng
+        self.lows = []
+
+    def edge(self, t):
+        return t + self.rng.gauss(0.0, self.jitter) if self.jitter else t
+
+    def release(self, cycle):
+        """The host released the line after its stop bit"""
+        t = cycle / self.mhz + self.delay_us
+        self.lows = []
+        bit_us = 4.0 * (1.0 + self.skew)
+        for b in self.bits:
+            self.lows.append((self.edge(t),
+                              self.edge(t + bit_us * (0.25 if b else 0.75))))
+            t += bit_us
+
+    def low(self, cycle):
+        t = cycle / self.mhz
+        return any(f <= t < r for f, r in self.lows)
+
+
+class Cpu:
+    def __init__(self, prog, mhz, controllers):
+        """controllers maps the bit of a data line to its Controller"""
+        self.prog = prog
+        self.mhz = mhz
+        self.controllers = controllers
+        self.r = [0] * 32
+        self.mem = {}
+        self.syms = {}
+        self.stack = []
+        self.z = self.c = self.t = False
+        self.cycle = 0
+        self.ddr = 0
+        self.ddr_log = []
+        self.samples = []
+        self.cli = None
+        self.sti = None
+
+    def pin(self):
+        v = 0xff
+        for bit in range(8):
+            ctl = self.controllers.get(bit)
+            if self.ddr & (1 << bit) or (ctl and ctl.low(self.cycle)):
+                v &= ~(1 << bit)
+        return v
+
+    def edges(self, bit):
+        """The (cycle, low) changes of the DDR bit of a line"""
+        return [(c, low) for c, b, low in self.ddr_log if b == bit]
+
+    def reg(self, a):
+        return int(a[1:])
+
+    def imm(self, a):
+        return self.prog.value(a) & 0xffff
+
+    def flags(self, v):
+        self.z = (v & 0xff) == 0
+        return v & 0xff
+
+    def run(self, func):
+        pc = self.prog.funcs[func]
+        self.stack.append(None)
+        r = self.r
+        while pc is not None:
+            op, a, tags, where = self.prog.code[pc]
+            n = CYCLES.get(op, 1)
+            nxt = pc + 1
+            if op == 'delay':
+                n = a[0]
+            elif op == 'tst':
+                self.flags(r[self.reg(a[0])])
+            elif op == 'in':
+                port = self.prog.io(a[1])
+                if port == 'SREG':
+                    r[self.reg(a[0])] = 0x80
+                else:
+                    r[self.reg(a[0])] = self.pin()
+                    self.samples.append((self.cycle, a[0], tags, where))
+            elif op == 'out':
+                v = r[self.reg(a[1])]
+                if self.prog.io(a[0]) == 'SREG':
+                    self.sti = self.cycle + 1
+                else:
+                    for bit in range(8):
+                        was, low = self.ddr >> bit & 1, v >> bit & 1
+                        if was == low:
+                            continue
+                        self.ddr_log.append((self.cycle + 1, bit, bool(low)))
+                        # The last release is the end of the stop bit
+                        if bit in self.controllers and not low:
+                            self.controllers[bit].release(self.cycle + 1)
+                    self.ddr = v
+            elif op == 'mov':
+                r[self.reg(a[0])] = r[self.reg(a[1])]
+            elif op == 'movw':
+                d, s = self.reg(a[0]), self.reg(a[1])
+                r[d], r[d + 1] = r[s], r[s + 1]
+            elif op == 'or':
+                d = self.reg(a[0])
+                r[d] = self.flags(r[d] | r[self.reg(a[1])])
+            elif op == 'and':
+                d = self.reg(a[0])
+                r[d] = self.flags(r[d] & r[self.reg(a[1])])
+            elif op == 'andi':
+                d = self.reg(a[0])
+                r[d] = self.flags(r[d] & self.imm(a[1]))
+            elif op == 'ori':
+                d = self.reg(a[0])
+                r[d] = self.flags(r[d] | self.imm(a[1]))
+            elif op == 'com':
+                d = self.reg(a[0])
+                r[d] = self.flags(~r[d])
+                self.c = True
+            elif op == 'ldi':
+                r[self.reg(a[0])] = self.imm(a[1]) & 0xff
+            elif op == 'lds':
+                r[self.reg(a[0])] = self.syms[a[1]]
+            elif op == 'lsl':
+                d = self.reg(a[0])
+                self.c = bool(r[d] & 0x80)
+                r[d] = self.flags(r[d] << 1)
+            elif op == 'rol':
+                d = self.reg(a[0])
+                c = self.c
+                self.c = bool(r[d] & 0x80)
+                r[d] = self.flags(r[d] << 1 | c)
+            elif op == 'dec':
+                d = self.reg(a[0])
+                r[d] = self.flags(r[d] - 1)
+            elif op == 'neg':
+                d = self.reg(a[0])
+                r[d] = self.flags(-r[d])
+                self.c = r[d] != 0
+            elif op == 'cp':
+                v, k = r[self.reg(a[0])], r[self.reg(a[1])]
+                self.z, self.c = v == k, v < k
+            elif op == 'cpi':
+                v, k = r[self.reg(a[0])], self.imm(a[1])
+                self.z, self.c = v == k, v < k
+            elif op == 'sub':
+                d = self.reg(a[0])
+                v, k = r[d], r[self.reg(a[1])]
+                self.c = v < k
+                r[d] = self.flags(v - k)
+            elif op == 'sbiw':
+                d = self.reg(a[0])
+                v = r[d] | r[d + 1] << 8
+                k = self.imm(a[1])
+                self.c = v < k
+                v = (v - k) & 0xffff
+                self.z = v == 0
+                r[d], r[d + 1] = v & 0xff, v >> 8
+            elif op == 'ld':
+                assert a[1] == 'Z+'
+                z = r[30] | r[31] << 8
+                r[self.reg(a[0])] = self.mem.get(z, 0)
+                z += 1
+                r[30], r[31] = z & 0xff, z >> 8
+            elif op == 'st':
+                assert a[0] == 'X+'
+                x = r[26] | r[27] << 8
+                self.mem[x] = r[self.reg(a[1])]
+                x += 1
+                r[26], r[27] = x & 0xff, x >> 8
+            elif op == 'bst':
+                self.t = bool(r[self.reg(a[0])] >> self.imm(a[1]) & 1)
+            elif op == 'bld':
+                d, b = self.reg(a[0]), self.imm(a[1])
+                r[d] = r[d] & ~(1 << b) & 0xff | self.t << b
+            elif op == 'sbrs':
+                if r[self.reg(a[0])] >> self.imm(a[1]) & 1:
+                    n += 1
+                    nxt += 1
+            elif op in ('set', 'clt'):
+                self.t = op == 'set'
+            elif op in ('sec', 'clc'):
+                self.c = op == 'sec'
+            elif op in BRANCHES:
+                taken = {'breq': self.z, 'brne': not self.z,
+                         'brcc': not self.c, 'brcs': self.c,
+                         'brts': self.t, 'brtc': not self.t}[op]
+                if taken:
+                    n += 1
+                    nxt = self.prog.target(pc, a[0])
+            elif op == 'rjmp':
+                nxt = self.prog.target(pc, a[0])
+            elif op in ('rcall', 'call'):
+                self.stack.append(nxt)
+                nxt = self.prog.target(pc, a[0])
+            elif op == 'ret':
+                nxt = self.stack.pop()
+            elif op == 'push':
+                self.stack.append(r[self.reg(a[0])])
+            elif op == 'pop':
+                r[self.reg(a[0])] = self.stack.pop()
+            elif op == 'cli':
+                self.cli = self.cycle + 1
+            elif op == 'sei':
+                self.sti = self.cycle + 1
+            elif op != 'nop':
+                raise ValueError('unknown instruction: ' + op)
+            self.cycle += n
+            pc = nxt
+
+    def transfer(self, port, tx, rx_len, func='joybus_transfer'):
+        """joybus_transfer(port, tx, len(tx), rx, rx_len)"""
+        for i, b in enumerate(tx):
+            self.mem[0x100 + i] = b
+        r = self.r
+        r[24] = port
+        r[22], r[23] = 0x00, 0x01
+        r[20] = len(tx)
+        r[18], r[19] = 0x00, 0x02
+        r[16] = rx_len
+        self.run(func)
+        rx = [self.mem.get(0x200 + i, 0) for i in range(rx_len)]
+        return r[24], rx
+
+    def stop_rx(self, port, rx_len):
+        """joybus_stop_rx(port, rx, rx_len)"""
+        r = self.r
+        r[24] = port
+        r[22], r[23] = 0x00, 0x02
+        r[20] = rx_len
+        self.run('joybus_stop_rx')
+        rx = [self.mem.get(0x200 + i, 0) for i in range(rx_len)]
+        return r[24], rx
+
+    def poll_sliced(self, mode, rumble_lines, follow=None):
+        """controller_poll_sliced(slices, follow), returns the late lines"""
+        self.syms['controller_mode'] = mode
+        self.syms['controller_rumble_lines'] = rumble_lines
+        self.r[24], self.r[25] = 0x00, 0x02
+        if follow is None:
+            follow = self.prog.names['CONTROLLER_DATA_MASK']
+        self.r[22] = follow
+        self.run('controller_poll_sliced')
+        slices = [self.mem.get(0x200 + i, 0)
+                  for i in range(self.prog.names['CONTROLLER_SLICES'])]
+        return self.r[24], slices
+
+
+def tx_bits(data):
+    return [(b >> (7 - i)) & 1 for b in data for i in range(8)] + [1]
+
+
+def bit_errors(edges, bits, mhz, jitter=0):
+    """Low times and bit times of the bits sent on a line, in cycles"""
+    falls = [c for c, low in edges if low]
+    rises = [c for c, low in edges if not low]
+    if len(falls) != len(bits) or len(rises) != len(bits):
+        return ['%d bits sent, expected %d' % (len(falls), len(bits))]
+    errors = []
+    for i, b in enumerate(bits):
+        want = mhz if b else 3 * mhz
+        if rises[i] - falls[i] != want:
+            errors.append('bit %d low %d cycles, expected %d' %
+                          (i, rises[i] - falls[i], want))
+        if i + 1 < len(bits) and \
+                abs(falls[i + 1] - falls[i] - 4 * mhz) > jitter:
+            errors.append('bit %d takes %d cycles, expected %d' %
+                          (i, falls[i + 1] - falls[i], 4 * mhz))
+    return errors
+
+
+def straight_cycles(prog, code):
+    """
+    The cycles of code run straight through, with the branches and skips not
+    taken and the calls counted through the ret of the function they call
+    """
+    n = 0
+    for op, a, _, _ in code:
+        if op == 'delay':
+            n += a[0]
+        elif op in ('call', 'rcall'):
+            body = []
+            for entry in prog.code[prog.funcs[a[0]]:]:
+                body.append(entry)
+                if entry[0] == 'ret':
+                    break
+            n += CYCLES[op] + straight_cycles(prog, body)
+        else:
+            n += CYCLES.get(op, 1)
+    return n
+
+
+def macro_uses(lines, macros, name):
+    """
+    The arguments of every use of the macro name in the source lines, with
+    those of the macros it's used in filled in
+    """
+    uses = []
+    for i, line in enumerate(lines):
+        code = line.split('/*')[0].strip()
+        op, _, args = code.partition(' ')
+        if op != name:
+            continue
+        args = [a.strip() for a in args.split(',')] if args.strip() else []
+        outer = [m for m, (_, first, last) in macros.items()
+                 if first < i < last]
+        for binding in macro_uses(lines, macros, outer[0]) if outer else [{}]:
+            uses.append(dict(zip(macros[name][0],
+                                 [fill(a, binding) for a in args])))
+    return uses
+
+
+def fill(line, binding):
+    """Puts the arguments of a macro use into a line of its body"""
+    for p, a in sorted(binding.items(), key=lambda x: -len(x[0])):
+        line = line.replace('\\' + p, a)
+    return line.replace('\\()', '')
+
+
+def check_labels(prog):
+    """
+    Checks the cycles labelled on the lines of controller.S against the
+    cycles the model counts for them, at the clock of prog. A line in a
+    macro may be labelled for any one of its uses, like a delay by one of
+    the macro's arguments. Returns the errors and the number of lines
+    checked.
+    """
+    lines = read('controller.S').splitlines()
+    macros = {}
+    for i, line in enumerate(lines):
+        m = re.match(r'\s*\.macro\s+(\w+)\s*(.*)$', line)
+        if m:
+            params = [p.strip() for p in m.group(2).split(',') if p.strip()]
+            last = next(j for j in range(i, len(lines))
+                        if lines[j].strip() == '.endm')
+            macros[m.group(1)] = (params, i, last)
+
+    errors = []
+    checked = 0
+    for i, line in enumerate(lines):
+        m = re.match(r'(.*?\S.*?)/\*\s*([^,]*?)\s*(,.*)?\*/\s*$', line)
+        if not m or m.group(1).strip().startswith('/*'):
+            continue
+        label = LABEL.match(m.group(2))
+        if not label:
+            continue
+        checked += 1
+        where = 'controller.S:%d' % (i + 1)
+        first, other = int(label.group(1)), label.group(2)
+        terms = re.findall(r'\d+', label.group(3))
+        total = first + sum(int(t) for t in terms)
+        if label.group(4) and int(label.group(4)) != total:
+            errors.append('%s: labelled %s, which adds up to %d' %
+                          (where, m.group(2), total))
+            continue
+        outer = [name for name, (_, a, b) in macros.items() if a < i < b]
+        uses = macro_uses(lines, macros, outer[0]) if outer else [{}]
+        counted = []
+        for binding in uses or [{}]:
+            code = prog.expand(fill(m.group(1).strip(), binding))
+            unknown = [op for op, _, _, _ in code
+                       if op not in CYCLES and op not in BRANCHES and
+                       op not in ('delay', 'sbrs')]
+            if unknown:
+                errors.append('%s: %s isn\'t in the model' %
+                              (where, unknown[0]))
+                break
+            # A use in an #if block of a bigger build
+            if any(op in ('call', 'rcall') and a[0] not in prog.funcs
+                   for op, a, _, _ in code):
+                continue
+            n = straight_cycles(prog, code)
+            op = code[0][0] if len(code) == 1 else None
+            if op in BRANCHES or op == 'sbrs':
+                ok = ({first, int(other)} == {n, n + 1} if other else
+                      first in (n, n + 1))
+            elif op in ('call', 'rcall'):
+                ok = total == n and first in (CYCLES[op], n)
+            elif op == 'ret':
+                # The call that came here added to it
+                ok = first == n
+            else:
+                ok = first == n and not other and total == n
+            if ok:
+                break
+            counted.append(n)
+        else:
+            if counted:
+                counted = ' or '.join(str(n) for n in sorted(set(counted)))
+                errors.append('%s: labelled %s, the model counts %s cycles' %
+                              (where, m.group(2), counted))
+    return errors, checked
+
+
+def check_tx(prog, mhz, bit, tx):
+    cpu = Cpu(prog, mhz, {})
+    cpu.transfer(0, tx, 0)
+    return bit_errors(cpu.edges(bit), tx_bits(tx), mhz)
+
+
+def check_rx(prog, mhz, bit, tx, resp, skew, delay_us, stop):
+    """
+    Receives resp and checks the data, the stop flag and the samples. With
+    tx None only the stop bit is sent, with joybus_stop_rx.
+    """
+    ctl = Controller(mhz, resp, skew, delay_us, stop != 0)
+    cpu = Cpu(prog, mhz, {bit: ctl})
+    if tx is None:
+        tx = []
+        ret, rx = cpu.stop_rx(0, len(resp))
+    else:
+        ret, rx = cpu.transfer(0, tx, len(resp))
+    errors = []
+    if ret != len(resp) | stop:
+        errors.append('returned 0x%02x, expected 0x%02x' %
+                      (ret, len(resp) | stop))
+    if rx != list(resp):
+        errors.append('received %s, expected %s' %
+                      (bytes(rx).hex(), bytes(resp).hex()))
+    bit_us = 4.0 * (1.0 + skew)
+    samples = [c for c, reg, _, where in cpu.samples
+               if where == 'joybus_rx' and reg == 'r18']
+    for i, (fall, _) in enumerate(ctl.lows):
+        t = [c / mhz - fall for c in samples if 0 <= c / mhz - fall < bit_us]
+        if len(t) != 1:
+            errors.append('bit %d sampled %d times' % (i, len(t)))
+            continue
+        lo, hi = bit_us / 4 + MARGIN_US, bit_us * 3 / 4 - MARGIN_US
+        if not lo <= t[0] <= hi:
+            errors.append('bit %d sampled at %.2f us, outside %.2f-%.2f' %
+                          (i, t[0], lo, hi))
+    wire = len(tx_bits(tx)) * 4 + delay_us + len(ctl.lows) * bit_us
+    return errors, (cpu.sti - cpu.cli) / mhz, wire
+
+
+def poll_response(rng):
+    resp = [rng.randrange(256) for _ in range(8)]
+    resp[0] &= 0x3f
+    resp[1] |= 0x80
+    return resp
+
+
+def check_sliced_tx(prog, mhz, mode, rumble_lines):
+    cpu = Cpu(prog, mhz, {})
+    cpu.poll_sliced(mode, rumble_lines)
+    errors = []
+    for bit in prog.data_bits():
+        tx = [0x40, mode, 0x01 if rumble_lines >> bit & 1 else 0x02]
+        errors += ['line %d: %s' % (bit, e) for e in
+                   bit_errors(cpu.edges(bit), tx_bits(tx), mhz,
+                              SLICED_JITTER)]
+    return errors
+
+
+def check_sliced_rx(prog, mhz, lines, delay_us, follow=None):
+    """
+    Polls with the controllers in lines, which maps a data line to its
+    (response, skew, lateness) or None for no controller, following the
+    lines in follow. Returns the errors, the set of lines reported late and
+    the cli time.
+    """
+    ctls = {bit: Controller(mhz, v[0], v[1], delay_us + v[2])
+            for bit, v in lines.items() if v is not None}
+    cpu = Cpu(prog, mhz, ctls)
+    late, slices = cpu.poll_sliced(3, 0, follow)
+    errors = []
+    reported = set()
+    for bit, v in lines.items():
+        if late >> bit & 1:
+            reported.add(bit)
+            continue
+        if v is None:
+            errors.append('line %d without a controller not reported' % bit)
+            continue
+        want = tx_bits(v[0])
+        got = [s >> bit & 1 for s in slices]
+        if got != want:
+            wrong = [i for i, (g, w) in enumerate(zip(got, want)) if g != w]
+            errors.append('line %d %.2f us late: bits %s wrong' %
+                          (bit, v[2], wrong[:8]))
+    return errors, reported, (cpu.sti - cpu.cli) / mhz
+
+
+def sliced_follow(bits, late, follow, port):
+    """
+    joypad_slices_follow() with a controller on every line: the lines the
+    next poll follows and the port followed last
+    """
+    if not any(late >> b & 1 for b in bits):
+        return follow, port
+    while True:
+        port = (port + 1) % len(bits)
+        if late >> bits[port] & 1:
+            return 1 << bits[port], port
+
+
+def check_sliced(prog, mhz, polls, rng, report):
+    bits = prog.data_bits()
+
+    errors = []
+    for mode in range(5):
+        for rumble in range(1 << len(bits)):
+            lines = sum(1 << b for i, b in enumerate(bits) if rumble >> i & 1)
+            errors += check_sliced_tx(prog, mhz, mode, lines)
+    report('%d MHz sliced tx' % mhz, errors)
+
+    def clock():
+        return rng.uniform(-0.05, 0.05)
+
+    errors = []
+    worst_cli = 0
+    for _ in range(polls):
+        skew = clock()
+        lines = {b: (poll_response(rng), skew, rng.uniform(0, LATE_OK_US))
+                 for b in bits}
+        first = rng.choice(bits)
+        lines[first] = lines[first][:2] + (0.0,)
+        e, late, cli = check_sliced_rx(prog, mhz, lines,
+                                       rng.uniform(1.0, 4.0))
+        errors += e + ['line %d %.2f us late reported late' %
+                       (b, lines[b][2]) for b in late]
+        worst_cli = max(worst_cli, cli)
+    report('%d MHz sliced rx poll' % mhz, errors,
+           'late up to %.2f us, cli up to %.1f us' % (LATE_OK_US, worst_cli))
+
+    # Two ports answering late are received in the same poll
+    errors = []
+    for _ in range(polls // 4):
+        skew = clock()
+        lines = {b: (poll_response(rng), skew, 0.0) for b in bits}
+        for b in bits[1:3]:
+            lines[b] = lines[b][:2] + (LATE_OK_US,)
+        e, late, _ = check_sliced_rx(prog, mhz, lines, rng.uniform(1.0, 4.0))
+        errors += e + ['line %d reported late' % b for b in late]
+    report('%d MHz sliced rx two late' % mhz, errors)
+
+    # Later than that, a line is reported or still received right
+    errors = []
+    for _ in range(polls):
+        skew = clock()
+        lines = {b: (poll_response(rng), skew, rng.uniform(0, 3.0))
+                 for b in bits}
+        first = rng.choice(bits)
+        lines[first] = lines[first][:2] + (0.0,)
+        e, late, _ = check_sliced_rx(prog, mhz, lines, rng.uniform(1.0, 4.0))
+        errors += e + ['line %d %.2f us late reported late' %
+                       (b, lines[b][2]) for b in late
+                       if lines[b][2] <= LATE_OK_US]
+    report('%d MHz sliced rx late' % mhz, errors)
+
+    errors = []
+    for _ in range(polls // 4):
+        skew = clock()
+        lines = {b: (poll_response(rng), skew, 0.0) for b in bits[:2]}
+        lines.update({b: None for b in bits[2:]})
+        e, late, _ = check_sliced_rx(prog, mhz, lines, rng.uniform(1.0, 4.0))
+        errors += e + ['line %d with a controller reported late' % b
+                       for b in late if lines[b] is not None]
+    report('%d MHz sliced rx absent' % mhz, errors)
+
+    # The lines drifting from the one they follow are received right
+    errors = []
+    for _ in range(polls):
+        skew = clock()
+        lines = {b: (poll_response(rng),
+                     skew + rng.uniform(0, SLICED_SKEW),
+                     rng.uniform(0, DRIFT_LATE_US)) for b in bits}
+        e, late, _ = check_sliced_rx(prog, mhz, lines, rng.uniform(1.0, 4.0))
+        errors += e + ['line %d %.2f us late with %+.2f%% reported late' %
+                       (b, lines[b][2], (lines[b][1] - skew) * 100)
+                       for b in late]
+    report('%d MHz sliced drift' % mhz, errors,
+           'clocks %.2f%% apart, late up to %.1f us' %
+           (SLICED_SKEW * 100, DRIFT_LATE_US))
+
+    # Off the phase, a line is reported or still received right, and with
+    # the ports followed in turn one reported is received right again within
+    # CONTROLLER_PORTS polls
+    errors = []
+    received = []
+    worst_gap = 0
+    mask = prog.names['CONTROLLER_DATA_MASK']
+    runs = max(1, polls // len(SLICED_SKEWS) // SLICED_RUN)
+    for skew in SLICED_SKEWS:
+        count = 0
+        for _ in range(runs):
+            clocks = {b: (rng.uniform(-skew, skew),
+                          rng.uniform(0, LATE_OK_US)) for b in bits}
+            first = rng.choice(bits)
+            clocks[first] = (clocks[first][0], 0.0)
+            follow, port = mask, 0
+            gaps = {b: 0 for b in bits}
+            for _ in range(SLICED_RUN):
+                lines = {b: (poll_response(rng),) + clocks[b] for b in bits}
+                e, late, _ = check_sliced_rx(prog, mhz, lines,
+                                             rng.uniform(1.0, 4.0), follow)
+                errors += ['skew %.0f%%: %s' % (skew * 100, s) for s in e]
+                count += len(late)
+                for b in bits:
+                    gaps[b] = gaps[b] + 1 if b in late else 0
+                    worst_gap = max(worst_gap, gaps[b])
+                follow, port = sliced_follow(
+                    bits, sum(1 << b for b in late), follow, port)
+        received.append('%.0f%% at %.0f%%' % (
+            100.0 - 100.0 * count / (runs * SLICED_RUN * len(bits)),
+            skew * 100))
+    if worst_gap > len(bits):
+        errors.append('a line reported %d polls in a row' % worst_gap)
+    report('%d MHz sliced rx skew' % mhz, errors,
+           'received %s, reported %d polls in a row' %
+           (', '.join(received), worst_gap))
+
+
+def check_spi(prog, mhz, polls, rng, report):
+    bit = prog.data_bits()[0]
+    stop = prog.names['JOYBUS_RX_STOP']
+    cpu = Cpu(prog, mhz, {})
+    cpu.stop_rx(0, 0)
+    errors = bit_errors(cpu.edges(bit), [1], mhz)
+    for skew in (-0.05, -0.02, 0.0, 0.02, 0.05):
+        for _ in range(polls // 5):
+            e, _, _ = check_rx(prog, mhz, bit, None, poll_response(rng), skew,
+                               rng.uniform(1.0, 4.0), stop)
+            errors += ['skew %+.0f%%: %s' % (skew * 100, s) for s in e]
+    report('%d MHz spi stop rx' % mhz, errors)
+
+
+def check_raw(prog, mhz, polls, rng, report):
+    bit = prog.data_bits()[0]
+    threshold = prog.names['ENC_BIT_THRESHOLD']
+    errors = []
+    worst_cli = 0
+    for _ in range(polls):
+        resp = poll_response(rng)
+        ctl = Controller(mhz, resp, rng.uniform(-FIXED_SKEW, FIXED_SKEW),
+                         rng.uniform(1.0, 4.0))
+        cpu = Cpu(prog, mhz, {bit: ctl})
+        _, raw = cpu.transfer(0, [0x40, 0x03, 0x00], len(resp) * 4,
+                              'joybus_transfer_raw')
+        worst_cli = max(worst_cli, (cpu.sti - cpu.cli) / mhz)
+        samples = [c for c, _, tags, _ in cpu.samples
+                   if 'controller_poll_recv_bit' in tags]
+        gaps = set(b - a for a, b in zip(samples, samples[1:]))
+        if gaps != {mhz}:
+            errors.append('samples %s cycles apart, expected %d' %
+                          (sorted(gaps), mhz))
+        levels = [b >> (7 - i) & 1 for b in raw for i in range(8)]
+        got = []
+        for i in range(0, len(levels), 4):
+            a, b, c, d = levels[i:i + 4]
+            got.append(int(a + 2 * b + 2 * c + d > threshold))
+        if got != tx_bits(resp)[:-1]:
+            errors.append('decoded %s, expected %s' %
+                          (got, tx_bits(resp)[:-1]))
+    report('%d MHz raw rx' % mhz, errors, 'cli up to %.1f us' % worst_cli)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--mhz', type=int, nargs='+', default=[16, 8])
+    parser.add_argument('--polls', type=int, default=200)
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    failed = False
+
+    def report(name, errors, extra=''):
+        nonlocal failed
+        failed |= bool(errors)
+        print('%-28s %-6s %s' % (name, 'FAILED' if errors else 'ok', extra))
+        for e in errors[:5]:
+            print('    ' + e)
+
+    # The labels are counted at 16 MHz, with all the routines built
+    errors, checked = check_labels(Program(16, ports=2, raw=1))
+    report('cycle labels', errors, '%d lines' % checked)
+
+    for mhz in args.mhz:
+        prog = Program(mhz)
+        bit = prog.data_bits()[0]
+        poll = [0x40, 0x03, 0x00]
+        timeout = prog.names['JOYBUS_TIMEOUT_US']
+
+        errors = []
+        for tx in ([0x00], [0xff], poll, [0x41], [0x55, 0xaa, 0x0f]):
+            errors += check_tx(prog, mhz, bit, tx)
+        for _ in range(args.polls):
+            tx = [rng.randrange(256) for _ in range(rng.randrange(1, 4))]
+            errors += check_tx(prog, mhz, bit, tx)
+        report('%d MHz tx bit widths' % mhz, errors)
+
+        errors = []
+        worst_cli = worst = None
+        for skew in (-0.05, -0.02, 0.0, 0.02, 0.05):
+            for _ in range(args.polls // 5):
+                delay = rng.uniform(1.0, 4.0)
+                e, cli, wire = check_rx(prog, mhz, bit, poll,
+                                        poll_response(rng), skew, delay,
+                                        prog.names['JOYBUS_RX_STOP'])
+                errors += ['skew %+.0f%%: %s' % (skew * 100, s) for s in e]
+                over = cli - wire - JOYBUS_END_US
+                worst = over if worst is None else max(worst, over)
+                worst_cli = cli if worst_cli is None else max(worst_cli, cli)
+        report('%d MHz rx poll' % mhz, errors)
+        report('%d MHz cli poll' % mhz, [] if worst <= OVERHEAD_US else
+               ['%.1f us over the wire + %d us' % (worst, JOYBUS_END_US)],
+               'cli up to %.1f us, wire + %d us %+.1f us' %
+               (worst_cli, JOYBUS_END_US, worst))
+
+        # Ends after a whole byte without the stop bit
+        e, _, _ = check_rx(prog, mhz, bit, poll, [0x00, 0x80, 0x03], 0.0,
+                           2.0, 0)
+        report('%d MHz rx no stop bit' % mhz, e)
+
+        # Probe: one byte out, three back
+        resp = [0x09, 0x00, 0x03]
+        e, cli, wire = check_rx(prog, mhz, bit, [0x00], resp, 0.0, 2.0,
+                                prog.names['JOYBUS_RX_STOP'])
+        report('%d MHz rx probe' % mhz, e, 'cli %.1f us' % cli)
+
+        # A response longer than the buffer has no stop flag
+        cpu = Cpu(prog, mhz, {bit: Controller(mhz, list(range(8)), 0.0,
+                                              2.0)})
+        ret, rx = cpu.transfer(0, poll, 4)
+        e = []
+        if ret != 4 or rx != [0, 1, 2, 3]:
+            e.append('returned 0x%02x %s for a short buffer' %
+                     (ret, bytes(rx).hex()))
+        report('%d MHz rx overlong' % mhz, e)
+
+        # Nothing answers
+        cpu = Cpu(prog, mhz, {})
+        ret, _ = cpu.transfer(0, poll, 8)
+        cli = (cpu.sti - cpu.cli) / mhz
+        limit = len(tx_bits(poll)) * 4 + timeout + OVERHEAD_US
+        e = []
+        if ret:
+            e.append('returned 0x%02x without a controller' % ret)
+        if cli > limit:
+            e.append('cli %.1f us, over %d us' % (cli, limit))
+        report('%d MHz cli no answer' % mhz, e,
+               'cli %.1f us, limit %d us' % (cli, limit))
+
+        for name, ports, raw, spi, check in (
+                ('sliced', 4, 0, 0, check_sliced),
+                ('spi', 1, 0, 1, check_spi),
+                ('raw', 1, 1, 0, check_raw)):
+            try:
+                prog = Program(mhz, ports, raw, spi)
+            except ConfigError as e:
+                print('%-28s %-6s %s' % ('%d MHz %s' % (mhz, name), '-',
+                                         'not built: %s' % e))
+                continue
+            check(prog, mhz, args.polls, rng, report)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""
+Turns the rumble motor of a controller on or off (needs pyusb):
+
+    rumble.py [--port 0] on|off
+
+The rumble is a vendor defined output report, which generic force
+feedback drivers don't drive. This sends it with SET_REPORT on the control
+pipe to the interface of the port. On Linux, writing the byte to the
+port's /dev/hidraw node does the same.
+"""
+
+import argparse
+import sys
+
+VENDOR_ID = 0xdead
+PRODUCT_ID = 0xbeef
+HID_SET_REPORT = 0x09
+HID_REPORT_OUTPUT = 0x02
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sets the rumble motor.')
+    parser.add_argument('--port', type=int, default=0, choices=range(4),
+                        help='controller port, i.e. interface (default 0)')
+    parser.add_argument('state', choices=('on', 'off'))
+    args = parser.parse_args()
+
+    import usb.core
+
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if dev is None:
+        sys.exit('device not found')
+    dev.ctrl_transfer(0x21, HID_SET_REPORT, HID_REPORT_OUTPUT << 8,
+                      args.port, bytes([args.state == 'on']))
+
+
+if __name__ == '__main__':
+    main()
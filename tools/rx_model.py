@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Runs the Joybus receivers of controller.S against a simulated controller
+and prints the response error rate as a function of the clock skew of the
+controller, for a few amounts of edge jitter:
+
+    rx_model.py [--mhz 16] [--polls 100]
+
+Both receivers are executed instruction by instruction on the AVR model of
+joybus_timing.py, so the curves have the cycle counts of the code itself:
+
+    fixed   joybus_rx as it was before it followed the edges, read from the
+            git history (--fixed-rev): samples every bit at a fixed phase
+            counted from the first falling edge, four times, 1-2-2-1
+            weighted, at 12 MHz and up, once in the middle below that
+    edge    joybus_rx of the tree: finds the falling edge of every bit and
+            samples it once in the middle
+
+The sample points of each receiver, in microseconds after the falling edge
+of the first and the last bit of a response without skew, are printed
+first. A response is counted as an error if any of its 64 bits or its stop
+bit is wrong, or if it ends early. The default run takes a few minutes.
+"""
+
+import argparse
+import random
+
+from joybus_timing import Controller, Cpu, Program
+
+# The last controller.S with the fixed phase receiver, the parent of "Follow
+# the controller clock edge by edge in joybus_rx"
+FIXED_REV = '389d12a^'
+POLL = [0x40, 0x03, 0x00]
+BYTES = 8
+
+
+def receive(prog, mhz, resp, skew, jitter, rng):
+    """Polls a controller sending resp, returns the Cpu and the Controller"""
+    bit = prog.data_bits()[0]
+    ctl = Controller(mhz, resp, skew, rng.uniform(2.0, 4.0), jitter=jitter,
+                     rng=rng)
+    cpu = Cpu(prog, mhz, {bit: ctl})
+    ret, rx = cpu.transfer(0, POLL, len(resp))
+    ok = ret == len(resp) | prog.names['JOYBUS_RX_STOP'] and rx == resp
+    return ok, cpu, ctl
+
+
+def sample_points(prog, mhz, rng):
+    """The samples taken in the first and the last bit, in us after its fall"""
+    resp = [rng.randrange(256) for _ in range(BYTES)]
+    _, cpu, ctl = receive(prog, mhz, resp, 0.0, 0.0, rng)
+    samples = [c / mhz for c, reg, _, where in cpu.samples
+               if where == 'joybus_rx' and reg != 'r0']
+    points = []
+    for fall, _ in (ctl.lows[0], ctl.lows[-2]):
+        points.append(' '.join('%.2f' % (t - fall) for t in samples
+                               if 0 <= t - fall < 4.0))
+    return points
+
+
+def error_rate(prog, mhz, skew, jitter, polls, rng):
+    errors = 0
+    for _ in range(polls):
+        resp = [rng.randrange(256) for _ in range(BYTES)]
+        ok, _, _ = receive(prog, mhz, resp, skew, jitter, rng)
+        errors += not ok
+    return errors / polls
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--mhz', type=int, default=16)
+    parser.add_argument('--polls', type=int, default=100)
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--fixed-rev', default=FIXED_REV)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    receivers = (('fixed', Program(args.mhz, rev=args.fixed_rev)),
+                 ('edge', Program(args.mhz)))
+    for name, prog in receivers:
+        first, last = sample_points(prog, args.mhz, rng)
+        print('%-6s samples at %s us, in the last bit %s us' %
+              (name, first, last))
+
+    skews = [-0.16, -0.08, -0.04, -0.02, -0.01, -0.005, 0.0, 0.005, 0.01,
+             0.02, 0.04, 0.08, 0.16]
+    print('%-6s %-7s' % ('rx', 'jitter') +
+          ''.join('%7.1f%%' % (s * 100) for s in skews))
+    for name, prog in receivers:
+        for jitter in (0.0, 0.02, 0.05, 0.1):
+            rates = [error_rate(prog, args.mhz, s, jitter, args.polls, rng)
+                     for s in skews]
+            print('%-6s %-7s' % (name, '%.2fus' % jitter) +
+                  ''.join('%8.3f' % r for r in rates))
+
+
+if __name__ == '__main__':
+    main()
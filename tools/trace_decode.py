@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Decodes the USB event trace of the firmware into a timeline.
+
+The trace is read from the device with vendor request 0x06 (needs pyusb),
+or from a serial console log, where it's written as "T <hex>" lines when
+the firmware halts:
+
+    trace_decode.py --usb
+    trace_decode.py console.log
+
+The timestamps are in Timer3 ticks at F_CPU/8, pass --mhz 8 for an 8 MHz
+build.
+"""
+
+import argparse
+import struct
+import sys
+
+VENDOR_ID = 0xdead
+PRODUCT_ID = 0xbeef
+REQ_GET_TRACE = 0x06
+REQ_CLEAR_TRACE = 0x07
+
+EVENT = struct.Struct('<BBHHH')
+TRACE_LEN = 32
+
+SETUP, SETUP_DATA, UDINT, STALL, SEND_FAIL = range(1, 6)
+
+REQUESTS = {
+    0: 'GET_STATUS', 1: 'CLEAR_FEATURE', 3: 'SET_FEATURE', 5: 'SET_ADDRESS',
+    6: 'GET_DESCRIPTOR', 7: 'SET_DESCRIPTOR', 8: 'GET_CONFIGURATION',
+    9: 'SET_CONFIGURATION', 10: 'GET_INTERFACE', 11: 'SET_INTERFACE',
+    12: 'SYNCH_FRAME',
+}
+
+UDINT_BITS = ['SUSPI', 'MSOFI', 'SOFI', 'EORSTI', 'WAKEUPI', 'EORSMI',
+              'UPRSMI']
+
+
+def read_usb():
+    import usb.core
+
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if dev is None:
+        sys.exit('device not found')
+
+    data = b''
+    while len(data) < TRACE_LEN * EVENT.size:
+        chunk = bytes(dev.ctrl_transfer(0xc0, REQ_GET_TRACE, 0,
+                                        len(data) // EVENT.size, 32))
+        if not chunk:
+            break
+        data += chunk
+    dev.ctrl_transfer(0x40, REQ_CLEAR_TRACE, 0, 0)
+    return data
+
+
+def read_log(f):
+    data = b''
+    for line in f:
+        line = line.strip()
+        if line.startswith('T '):
+            data += bytes.fromhex(line[2:])
+    return data
+
+
+def describe(typ, a, b):
+    if typ == SETUP:
+        req = a >> 8
+        return 'SETUP type 0x%02x %s value 0x%04x' % (
+            a & 0xff, REQUESTS.get(req, '0x%02x' % req), b)
+    if typ == SETUP_DATA:
+        return '      index 0x%04x length %d' % (a, b)
+    if typ == UDINT:
+        bits = [n for i, n in enumerate(UDINT_BITS) if a & (1 << i)]
+        return 'UDINT %s' % ' '.join(bits)
+    if typ == STALL:
+        return 'STALL ep %d' % a
+    if typ == SEND_FAIL:
+        return 'SEND port %d banks full' % a
+    return 'unknown event %d: 0x%04x 0x%04x' % (typ, a, b)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decodes the USB trace.')
+    parser.add_argument('--usb', action='store_true',
+                        help='read the trace from the device')
+    parser.add_argument('--mhz', type=int, default=16, choices=(8, 16),
+                        help='F_CPU of the build in MHz (default 16)')
+    parser.add_argument('log', nargs='?', help='console log, default stdin')
+    args = parser.parse_args()
+    # Timer3 runs at F_CPU/8
+    ticks_per_us = args.mhz // 8
+
+    if args.usb:
+        data = read_usb()
+    elif args.log:
+        with open(args.log, errors='replace') as f:
+            data = read_log(f)
+    else:
+        data = read_log(sys.stdin)
+
+    prev = None
+    for off in range(0, len(data) - EVENT.size + 1, EVENT.size):
+        typ, frame, time, a, b = EVENT.unpack_from(data, off)
+        # The time wraps every 65536 ticks, the frame number resolves it
+        if prev is None:
+            delta = ''
+        else:
+            dt = (time - prev[1]) & 0xffff
+            df = (frame - prev[0]) & 0xff
+            if df > 32:
+                delta = '+%d ms' % df
+            else:
+                delta = '+%d us' % (dt // ticks_per_us)
+        prev = (frame, time)
+        print('frame %3d %10s  %s' % (frame, delta, describe(typ, a, b)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,104 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "debug.h"
+#include "trace.h"
+
+#if USB_TRACE
+
+#if TRACE_LEN & (TRACE_LEN - 1) || TRACE_LEN > 128
+#error "TRACE_LEN must be a power of two, at most 128"
+#endif
+
+static struct trace_event trace_events[TRACE_LEN];
+static uint8_t trace_head;
+static uint8_t trace_count;
+static uint8_t trace_frozen;
+
+/* Callable from any context */
+void trace_add(uint8_t type, uint16_t a, uint16_t b)
+{
+    struct trace_event *ev;
+    uint8_t status;
+
+    status = SREG;
+    cli();
+    if (!trace_frozen) {
+        ev = &trace_events[trace_head++ & (TRACE_LEN - 1)];
+        ev->type = type;
+        ev->frame = UDFNUML;
+        ev->time = TCNT3;
+        ev->a = a;
+        ev->b = b;
+        if (trace_count < TRACE_LEN)
+            ++trace_count;
+    }
+    SREG = status;
+}
+
+/* Stops adding events so that the trace can be read out consistently */
+void trace_freeze(void)
+{
+    trace_frozen = 1;
+}
+
+/* Empties the trace and starts adding events again */
+void trace_clear(void)
+{
+    uint8_t status;
+
+    status = SREG;
+    cli();
+    trace_head = 0;
+    trace_count = 0;
+    trace_frozen = 0;
+    SREG = status;
+}
+
+/*
+ * Copies the idx'th event counting from the oldest one. Returns 0 when idx is
+ * past the end of the trace.
+ */
+uint8_t trace_read(uint8_t idx, struct trace_event *ev)
+{
+    uint8_t status, ret = 0;
+
+    status = SREG;
+    cli();
+    if (idx < trace_count) {
+        *ev = trace_events[(uint8_t)(trace_head - trace_count + idx) &
+                           (TRACE_LEN - 1)];
+        ret = 1;
+    }
+    SREG = status;
+
+    return ret;
+}
+
+/*
+ * Writes the trace to the console as hex, one event per line, oldest first.
+ * Only for fatal errors, this waits for the console.
+ */
+void trace_dump(void)
+{
+    static const char hex[] PROGMEM = "0123456789abcdef";
+    struct trace_event ev;
+    const uint8_t *p;
+    uint8_t i, j;
+
+    trace_freeze();
+    debug_putc_sync('\n');
+    for (i = 0; trace_read(i, &ev); ++i) {
+        debug_putc_sync('T');
+        debug_putc_sync(' ');
+        p = (const uint8_t *)&ev;
+        for (j = 0; j < sizeof(ev); ++j) {
+            debug_putc_sync(pgm_read_byte(&hex[p[j] >> 4]));
+            debug_putc_sync(pgm_read_byte(&hex[p[j] & 0xf]));
+        }
+        debug_putc_sync('\n');
+    }
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Set to 0 to leave out the USB event trace */
+#ifndef USB_TRACE
+#define USB_TRACE 1
+#endif
+
+/* Number of events kept, must be a power of two */
+#define TRACE_LEN 32
+
+/*
+ * The trace is a circular buffer of the last TRACE_LEN events. Each event is
+ * stamped with the low byte of the frame number and Timer3, which runs at
+ * F_CPU/8, i.e. SCHED_TICKS_PER_US ticks per microsecond.
+ * tools/trace_decode.py turns a dump into a timeline.
+ */
+struct trace_event {
+    uint8_t type;
+    uint8_t frame;
+    uint16_t time;
+    uint16_t a;
+    uint16_t b;
+} __attribute__((packed));
+
+enum trace_type {
+    TRACE_SETUP = 1,            /* a = bmRequestType | bRequest<<8, b = wValue */
+    TRACE_SETUP_DATA,       /* a = wIndex, b = wLength */
+    TRACE_UDINT,            /* a = UDINT, SOF only interrupts are left out */
+    TRACE_STALL,            /* a = endpoint */
+    TRACE_SEND_FAIL,        /* a = port, its endpoint banks are full */
+};
+
+#if USB_TRACE
+void trace_add(uint8_t type, uint16_t a, uint16_t b);
+void trace_freeze(void);
+void trace_clear(void);
+uint8_t trace_read(uint8_t idx, struct trace_event *ev);
+void trace_dump(void);
+#else
+static inline void trace_add(uint8_t type, uint16_t a, uint16_t b) {}
+static inline void trace_dump(void) {}
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef USB_H
 #define USB_H
 
+#include <stddef.h>
+
 enum usb_endpoint_types {
     USB_EP_TYPE_CONTROL = 0,
     USB_EP_TYPE_ISOCHRONOUS = 1,
@@ -22,6 +24,11 @@ enum usb_request_codes {
     USB_REQ_SYNCH_FRAME =       12,
 };
 
+enum usb_feature_selectors {
+    USB_FEATURE_ENDPOINT_HALT =         0,
+    USB_FEATURE_DEVICE_REMOTE_WAKEUP =  1,
+};
+
 enum usb_descriptor_type {
     USB_DESC_TYPE_DEVICE        = 0x01,
     USB_DESC_TYPE_CONFIGURATION = 0x02,
@@ -127,6 +134,8 @@ enum usages {
     RX          = 0x33,
     RY          = 0x34,
     RZ          = 0x35,
+    SLIDER      = 0x36,
+    DIAL        = 0x37,
 };
 
 enum inptu_bits_0 {
@@ -152,16 +161,23 @@ enum inptu_bits_2 {
 #define USAGE_MAXIMUM(x)    0x29, (x),
 #define LOGICAL_MINIMUM(x)  0x15, (x),
 #define LOGICAL_MAXIMUM(x)  0x25, (x),
+/* The one byte items are signed, above 127 needs two bytes */
+#define LOGICAL_MAXIMUM16(x) 0x26, (x) & 0xff, (x) >> 8,
 #define REPORT_COUNT(x)     0x95, (x),
 #define REPORT_SIZE(x)      0x75, (x),
 #define INPUT(b0, b1, b2)   0x81, ((b0) | (b1) | (b2)),
+#define OUTPUT(b0, b1, b2)  0x91, ((b0) | (b1) | (b2)),
+#define FEATURE(b0, b1, b2) 0xb1, ((b0) | (b1) | (b2)),
+/* The first vendor defined page, 0xff00, needs a two byte item */
+#define USAGE_PAGE_VENDOR   0x06, 0x00, 0xff,
 
+/* str is a wide string literal, which goes in without its terminator */
 #define USB_STRING_DESCRIPTOR(name, str) \
     static const struct { \
         uint8_t length; \
         uint8_t descriptor_type; \
-        int16_t string[sizeof(str)]; \
-    } __attribute__((packed)) name = { \
+        wchar_t string[sizeof(str) / sizeof(wchar_t) - 1]; \
+    } __attribute__((packed)) name PROGMEM = { \
         .length             = sizeof(name), \
         .descriptor_type    = USB_DESC_TYPE_STRING,\
         .string             = {str},\
@@ -184,5 +200,12 @@ enum hid_requests {
     USB_HID_SET_PROTOCOL    = 0x0b,
 };
 
+/* Report types in the high byte of wValue of GET_REPORT and SET_REPORT */
+enum hid_report_types {
+    USB_HID_REPORT_INPUT    = 0x01,
+    USB_HID_REPORT_OUTPUT   = 0x02,
+    USB_HID_REPORT_FEATURE  = 0x03,
+};
+
 
 #endif